@@ -24,6 +24,7 @@
 #include <string.h>
 
 #include "bitstream.h"
+#include "qrarena.h"
 
 #define DEFAULT_BUFSIZE (128)
 
@@ -31,16 +32,17 @@ BitStream *BitStream_new(void)
 {
 	BitStream *bstream;
 
-	bstream = (BitStream *)malloc(sizeof(BitStream));
+	bstream = (BitStream *)QRarena_alloc(sizeof(BitStream));
 	if(bstream == NULL) return NULL;
 
 	bstream->length = 0;
-	bstream->data = (unsigned char *)malloc(DEFAULT_BUFSIZE);
+	bstream->data = (unsigned char *)QRarena_alloc(DEFAULT_BUFSIZE);
 	if(bstream->data == NULL) {
-		free(bstream);
+		QRarena_free(bstream);
 		return NULL;
 	}
 	bstream->datasize = DEFAULT_BUFSIZE;
+	bstream->acc = 0;
 
 	return bstream;
 }
@@ -49,7 +51,7 @@ static int BitStream_expand(BitStream *bstream)
 {
 	unsigned char *data;
 
-	data = (unsigned char *)realloc(bstream->data, bstream->datasize * 2);
+	data = (unsigned char *)QRarena_realloc(bstream->data, bstream->datasize * 2);
 	if(data == NULL) {
 		return -1;
 	}
@@ -60,44 +62,55 @@ static int BitStream_expand(BitStream *bstream)
 	return 0;
 }
 
-static void BitStream_writeNum(unsigned char *dest, int bits, unsigned int num)
+/* Make room for bits more bits. */
+static int BitStream_reserve(BitStream *bstream, int bits)
 {
-	unsigned int mask;
-	int i;
+	int ret;
+
+	while(bstream->datasize * 8 - bstream->length < bits) {
+		ret = BitStream_expand(bstream);
+		if(ret < 0) return ret;
+	}
+
+	return 0;
+}
+
+/* Append up to 32 bits, emitting the completed bytes. */
+static void BitStream_writeNum(BitStream *bstream, int bits, unsigned int num)
+{
+	unsigned long long acc;
+	int pending;
 	unsigned char *p;
 
-	p = dest;
-	mask = 1 << (bits - 1);
-	for(i = 0; i < bits; i++) {
-		if(num & mask) {
-			*p = 1;
-		} else {
-			*p = 0;
-		}
-		p++;
-		mask = mask >> 1;
+	pending = bstream->length & 7;
+	acc = (bstream->acc << bits) | (num & ((1ULL << bits) - 1));
+	pending += bits;
+	p = bstream->data + bstream->length / 8;
+	while(pending >= 8) {
+		pending -= 8;
+		*p++ = (unsigned char)(acc >> pending);
 	}
+	bstream->acc = acc & ((1U << pending) - 1);
+	bstream->length += bits;
 }
 
-static void BitStream_writeBytes(unsigned char *dest, int size, unsigned char *data)
+static void BitStream_writeBytes(BitStream *bstream, int size, const unsigned char *data)
 {
-	unsigned char mask;
-	int i, j;
+	int i;
+	int pending;
 	unsigned char *p;
 
-	p = dest;
-	for(i = 0; i < size; i++) {
-		mask = 0x80;
-		for(j = 0; j < 8; j++) {
-			if(data[i] & mask) {
-				*p = 1;
-			} else {
-				*p = 0;
-			}
-			p++;
-			mask = mask >> 1;
+	pending = bstream->length & 7;
+	p = bstream->data + bstream->length / 8;
+	if(pending == 0) {
+		memcpy(p, data, size);
+	} else {
+		for(i = 0; i < size; i++) {
+			p[i] = (unsigned char)((bstream->acc << (8 - pending)) | (data[i] >> pending));
+			bstream->acc = data[i] & ((1U << pending) - 1);
 		}
 	}
+	bstream->length += size * 8;
 }
 
 int BitStream_append(BitStream *bstream, BitStream *arg)
@@ -111,13 +124,13 @@ int BitStream_append(BitStream *bstream, BitStream *arg)
 		return 0;
 	}
 
-	while(bstream->length + arg->length > bstream->datasize) {
-		ret = BitStream_expand(bstream);
-		if(ret < 0) return ret;
-	}
+	ret = BitStream_reserve(bstream, arg->length);
+	if(ret < 0) return ret;
 
-	memcpy(bstream->data + bstream->length, arg->data, arg->length);
-	bstream->length += arg->length;
+	BitStream_writeBytes(bstream, arg->length / 8, arg->data);
+	if(arg->length & 7) {
+		BitStream_writeNum(bstream, arg->length & 7, (unsigned int)arg->acc);
+	}
 
 	return 0;
 }
@@ -128,12 +141,14 @@ int BitStream_appendNum(BitStream *bstream, int bits, unsigned int num)
 
 	if(bits == 0) return 0;
 
-	while(bstream->datasize - bstream->length < bits) {
-		ret = BitStream_expand(bstream);
-		if(ret < 0) return ret;
+	ret = BitStream_reserve(bstream, bits);
+	if(ret < 0) return ret;
+
+	while(bits > 32) {
+		BitStream_writeNum(bstream, 32, 0);
+		bits -= 32;
 	}
-	BitStream_writeNum(bstream->data + bstream->length, bits, num);
-	bstream->length += bits;
+	BitStream_writeNum(bstream, bits, num);
 
 	return 0;
 }
@@ -144,52 +159,33 @@ int BitStream_appendBytes(BitStream *bstream, int size, unsigned char *data)
 
 	if(size == 0) return 0;
 
-	while(bstream->datasize - bstream->length < size * 8) {
-		ret = BitStream_expand(bstream);
-		if(ret < 0) return ret;
-	}
-	BitStream_writeBytes(bstream->data + bstream->length, size, data);
-	bstream->length += size * 8;
+	ret = BitStream_reserve(bstream, size * 8);
+	if(ret < 0) return ret;
+
+	BitStream_writeBytes(bstream, size, data);
 
 	return 0;
 }
 
 unsigned char *BitStream_toByte(BitStream *bstream)
 {
-	int i, j, size, bytes, oddbits;
-	unsigned char *data, v;
-	unsigned char *p;
+	int size, bytes, oddbits;
+	unsigned char *data;
 
 	size = BitStream_size(bstream);
 	if(size == 0) {
 		return NULL;
 	}
-	data = (unsigned char *)malloc((size + 7) / 8);
+	data = (unsigned char *)QRarena_alloc((size + 7) / 8);
 	if(data == NULL) {
 		return NULL;
 	}
 
-	bytes = size  / 8;
-
-	p = bstream->data;
-	for(i = 0; i < bytes; i++) {
-		v = 0;
-		for(j = 0; j < 8; j++) {
-			v = v << 1;
-			v |= *p;
-			p++;
-		}
-		data[i] = v;
-	}
+	bytes = size / 8;
+	memcpy(data, bstream->data, bytes);
 	oddbits = size & 7;
 	if(oddbits > 0) {
-		v = 0;
-		for(j = 0; j < oddbits; j++) {
-			v = v << 1;
-			v |= *p;
-			p++;
-		}
-		data[bytes] = v << (8 - oddbits);
+		data[bytes] = (unsigned char)(bstream->acc << (8 - oddbits));
 	}
 
 	return data;
@@ -198,7 +194,7 @@ unsigned char *BitStream_toByte(BitStream *bstream)
 void BitStream_free(BitStream *bstream)
 {
 	if(bstream != NULL) {
-		free(bstream->data);
-		free(bstream);
+		QRarena_free(bstream->data);
+		QRarena_free(bstream);
 	}
 }
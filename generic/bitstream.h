@@ -22,10 +22,16 @@
 #ifndef BITSTREAM_H
 #define BITSTREAM_H
 
+/**
+ * Bits are packed MSB first. data holds the length / 8 complete bytes, the
+ * remaining length % 8 bits are kept in the low bits of acc until a byte
+ * is complete.
+ */
 typedef struct {
-	int length;
+	int length;		///< bits
 	unsigned char *data;
-	int datasize;
+	int datasize;		///< bytes
+	unsigned long long acc;
 } BitStream;
 
 extern BitStream *BitStream_new(void);
@@ -33,7 +39,7 @@ extern int BitStream_append(BitStream *bstream, BitStream *arg);
 extern int BitStream_appendNum(BitStream *bstream, int bits, unsigned int num);
 extern int BitStream_appendBytes(BitStream *bstream, int size, unsigned char *data);
 #define BitStream_size(__bstream__) (__bstream__->length)
-#define BitStream_reset(__bstream__) (__bstream__->length = 0)
+#define BitStream_reset(__bstream__) (__bstream__->length = 0, __bstream__->acc = 0)
 extern unsigned char *BitStream_toByte(BitStream *bstream);
 extern void BitStream_free(BitStream *bstream);
 
@@ -23,10 +23,14 @@
 #include <string.h>
 #include <limits.h>
 #include <errno.h>
+#include <stdint.h>
 
 #include "qrencode.h"
 #include "qrspec.h"
 #include "mask.h"
+#include "qrstats.h"
+#include "qrarena.h"
+#include "qratomic.h"
 
 int Mask_writeFormatInformation(int width, unsigned char *frame, int mask, QRecLevel level)
 {
@@ -316,39 +320,519 @@ int Mask_evaluateSymbol(int width, unsigned char *frame)
 	return demerit;
 }
 
+/**
+ * Bit-packed evaluation. The masked symbol is packed into 64-bit words, rows
+ * and a transposed copy for the columns, so that the 2x2 blocks of N2 are
+ * found by word-wide AND/OR and popcount, and the run lengths for N1 and N3
+ * by iterating over the set bits of (line ^ (line << 1)) instead of
+ * comparing module by module. The demerit is the same as
+ * Mask_evaluateSymbol()'s.
+ */
+#define BOARD_WORDS ((QRSPEC_WIDTH_MAX + 63) / 64)
+
+typedef struct {
+	int width;
+	uint64_t rows[QRSPEC_WIDTH_MAX][BOARD_WORDS];	///< bit x of rows[y] is (x, y)
+	uint64_t cols[QRSPEC_WIDTH_MAX][BOARD_WORDS];	///< bit y of cols[x] is (x, y)
+} MaskBoard;
+
+#if defined(__GNUC__)
+#define Mask_popcount(__w__) __builtin_popcountll(__w__)
+#define Mask_ctz(__w__) __builtin_ctzll(__w__)
+#else
+static int Mask_popcount(uint64_t w)
+{
+	w = w - ((w >> 1) & 0x5555555555555555ULL);
+	w = (w & 0x3333333333333333ULL) + ((w >> 2) & 0x3333333333333333ULL);
+	w = (w + (w >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	return (int)((w * 0x0101010101010101ULL) >> 56);
+}
+
+static int Mask_ctz(uint64_t w)
+{
+	int n = 0;
+
+	while((w & 1) == 0) {
+		w >>= 1;
+		n++;
+	}
+	return n;
+}
+#endif
+
+/* Bits of the k-th word that lie inside the symbol. */
+static uint64_t Mask_boardMask(int width, int k)
+{
+	int bits = width - k * 64;
+
+	return (bits >= 64) ? ~(uint64_t)0 : ((uint64_t)1 << bits) - 1;
+}
+
+static void Mask_packBoard(int width, const unsigned char *frame, MaskBoard *board)
+{
+	int x, y;
+	uint64_t b;
+
+	board->width = width;
+	memset(board->rows, 0, sizeof(board->rows[0]) * width);
+	memset(board->cols, 0, sizeof(board->cols[0]) * width);
+
+	for(y = 0; y < width; y++) {
+		for(x = 0; x < width; x++) {
+			b = *frame++ & 1;
+			board->rows[y][x >> 6] |= b << (x & 63);
+			board->cols[x][y >> 6] |= b << (y & 63);
+		}
+	}
+}
+
+static int Mask_calcN2Board(const MaskBoard *board)
+{
+	int y, k;
+	int width = board->width;
+	int words = (width + 63) / 64;
+	uint64_t both, any, carryBoth, carryAny, blocks;
+	int count = 0;
+
+	for(y = 1; y < width; y++) {
+		carryBoth = carryAny = 0;
+		for(k = 0; k < words; k++) {
+			both = board->rows[y][k] & board->rows[y - 1][k];
+			any = board->rows[y][k] | board->rows[y - 1][k];
+			/* bit x: the block of columns x-1 and x is all dark or all light */
+			blocks = (both & ((both << 1) | carryBoth)) | ~(any | (any << 1) | carryAny);
+			carryBoth = both >> 63;
+			carryAny = any >> 63;
+			if(k == 0) blocks &= ~(uint64_t)1;
+			count += Mask_popcount(blocks & Mask_boardMask(width, k));
+		}
+	}
+
+	return count * N2;
+}
+
+/* Same run length list as Mask_calcRunLengthH() of a bit-packed line. */
+static int Mask_calcRunLengthBits(int width, const uint64_t *line, int *runLength)
+{
+	int head;
+	int k, pos, prev = 0;
+	int words = (width + 63) / 64;
+	uint64_t edges, carry = 0;
+
+	if(line[0] & 1) {
+		runLength[0] = -1;
+		head = 1;
+	} else {
+		head = 0;
+	}
+
+	for(k = 0; k < words; k++) {
+		/* bit x: module x differs from module x-1 */
+		edges = line[k] ^ ((line[k] << 1) | carry);
+		carry = line[k] >> 63;
+		if(k == 0) edges &= ~(uint64_t)1;
+		edges &= Mask_boardMask(width, k);
+		while(edges != 0) {
+			pos = k * 64 + Mask_ctz(edges);
+			runLength[head++] = pos - prev;
+			prev = pos;
+			edges &= edges - 1;
+		}
+	}
+	runLength[head] = width - prev;
+
+	return head + 1;
+}
+
+static int Mask_evaluateBoard(const MaskBoard *board)
+{
+	int i;
+	int demerit;
+	int runLength[QRSPEC_WIDTH_MAX + 1];
+	int length;
+
+	demerit = Mask_calcN2Board(board);
+
+	for(i = 0; i < board->width; i++) {
+		length = Mask_calcRunLengthBits(board->width, board->rows[i], runLength);
+		demerit += Mask_calcN1N3(length, runLength);
+		length = Mask_calcRunLengthBits(board->width, board->cols[i], runLength);
+		demerit += Mask_calcN1N3(length, runLength);
+	}
+
+	return demerit;
+}
+
+/**
+ * Mask patterns. maskPatterns[version][mask] holds one byte per module, 1 where
+ * the mask flips a data module and 0 elsewhere, function patterns included,
+ * so that a mask is applied by a plain XOR. They only depend on the
+ * version and are built from the first frame of that version, in one block
+ * that is published without a lock, see qratomic.h.
+ */
+static unsigned char **maskPatterns[QRSPEC_VERSION_MAX + 1];
+
+static unsigned char **Mask_getPatterns(int width, const unsigned char *frame)
+{
+	int version = (width - 17) / 4;
+	int w2 = width * width;
+	unsigned char **patterns, **prev;
+	unsigned char *function, *p;
+	int i, j;
+
+	patterns = QRatomic_loadPtr(&maskPatterns[version]);
+	if(patterns != NULL) return patterns;
+
+	patterns = (unsigned char **)malloc(sizeof(unsigned char *) * maskNum + (size_t)w2 * maskNum);
+	function = (unsigned char *)malloc(w2);
+	if(patterns == NULL || function == NULL) {
+		free(patterns);
+		free(function);
+		errno = ENOMEM;
+		return NULL;
+	}
+	for(j = 0; j < w2; j++) {
+		function[j] = frame[j] & 0x80;
+	}
+	p = (unsigned char *)(patterns + maskNum);
+	for(i = 0; i < maskNum; i++) {
+		patterns[i] = p;
+		maskMakers[i](width, function, p);
+		for(j = 0; j < w2; j++) {
+			p[j] &= 1;
+		}
+		p += w2;
+	}
+	free(function);
+
+	prev = QRatomic_publishPtr(&maskPatterns[version], patterns);
+	if(prev != NULL) {
+		free(patterns);
+		patterns = prev;
+	}
+
+	return patterns;
+}
+
+void Mask_clearCache(void)
+{
+	int i;
+
+	for(i = 1; i <= QRSPEC_VERSION_MAX; i++) {
+		free(QRatomic_exchangePtr(&maskPatterns[i], NULL));
+	}
+}
+
+/* Same as maskMakers[], eight modules at a time. */
+static int Mask_applyPattern(int width, const unsigned char *s, const unsigned char *pattern, unsigned char *d)
+{
+	int i;
+	int w2 = width * width;
+	int b = 0;
+	uint64_t src, bits;
+
+	for(i = 0; i + 8 <= w2; i += 8) {
+		memcpy(&src, s + i, 8);
+		memcpy(&bits, pattern + i, 8);
+		src ^= bits;
+		memcpy(d + i, &src, 8);
+		b += Mask_popcount(src & 0x0101010101010101ULL);
+	}
+	for(; i < w2; i++) {
+		d[i] = s[i] ^ pattern[i];
+		b += (int)(d[i] & 1);
+	}
+
+	return b;
+}
+
+static int Mask_evaluateMask(int width, unsigned char *frame, unsigned char **patterns, int i, QRecLevel level, unsigned char *mask, MaskBoard *board)
+{
+	int blacks;
+	int bratio;
+	int demerit;
+	int w2 = width * width;
+
+//	n1 = n2 = n3 = n4 = 0;
+	blacks = Mask_applyPattern(width, frame, patterns[i], mask);
+	blacks += Mask_writeFormatInformation(width, mask, i, level);
+	bratio = (200 * blacks + w2) / w2 / 2; /* (int)(100*blacks/w2+0.5) */
+	demerit = (abs(bratio - 50) / 5) * N4;
+//	n4 = demerit;
+	Mask_packBoard(width, mask, board);
+	demerit += Mask_evaluateBoard(board);
+//	printf("(%d,%d,%d,%d)=%d\n", n1, n2, n3 ,n4, demerit);
+
+	return demerit;
+}
+
+/**
+ * Parallel mask selection. The candidates of symbols of version
+ * parallelVersion or larger are scored by the calling thread and up to
+ * parallelThreads - 1 helpers of a pool shared by all threads. The helpers
+ * are created on first use, wait for jobs on a queue and are joined at
+ * exit. Threads that are themselves one of many encoders, such as the
+ * batch and async workers, opt out with Mask_setThreadParallel(). The
+ * selection is the same as the sequential one: lowest demerit, lowest mask
+ * number on ties.
+ */
+#define MASK_PARALLEL_VERSION (20)
+
+static long parallelVersion = MASK_PARALLEL_VERSION;
+static long parallelThreads = 1;
+
+void Mask_setParallel(int version, int threads)
+{
+	QRatomic_storeLong(&parallelVersion, version);
+	QRatomic_storeLong(&parallelThreads, (threads > maskNum) ? maskNum : threads);
+}
+
+void Mask_getParallel(int *version, int *threads)
+{
+	*version = (int)QRatomic_loadLong(&parallelVersion);
+	*threads = (int)QRatomic_loadLong(&parallelThreads);
+}
+
+/* Set in the threads that must not use the pool. */
+static Tcl_ThreadDataKey Mask_serialKey;
+
+int Mask_setThreadParallel(int enabled)
+{
+	int *serial = (int *)Tcl_GetThreadData(&Mask_serialKey, sizeof(int));
+	int previous = !*serial;
+
+	*serial = !enabled;
+
+	return previous;
+}
+
+typedef struct MaskJob {
+	int width;
+	unsigned char *frame;
+	unsigned char **patterns;
+	QRecLevel level;
+	int threads;	///< calling thread included
+	int helpers;
+	int next;		///< next mask to score
+	int finished;
+	int queued;
+	int demerit[maskNum];
+	struct MaskJob *nextJob;
+} MaskJob;
+
+static struct {
+	Tcl_Mutex mutex;
+	Tcl_Condition work;
+	Tcl_Condition done;
+	MaskJob *head;
+	MaskJob *tail;
+	int workers;
+	int shutdown;
+	Tcl_ThreadId threads[maskNum];
+} maskPool;
+
+/* Called with the pool mutex held. */
+static void Mask_dequeueJob(MaskJob *job)
+{
+	MaskJob *p, *prev = NULL;
+
+	if(!job->queued) return;
+	for(p = maskPool.head; p != job; p = p->nextJob) {
+		prev = p;
+	}
+	if(prev != NULL) {
+		prev->nextJob = job->nextJob;
+	} else {
+		maskPool.head = job->nextJob;
+	}
+	if(maskPool.tail == job) {
+		maskPool.tail = prev;
+	}
+	job->queued = 0;
+}
+
+/*
+ * Score masks of the job until none is left. Called and returns with the
+ * pool mutex held, the job must not be touched once it has been left.
+ */
+static void Mask_runJob(MaskJob *job, unsigned char *mask, MaskBoard *board)
+{
+	int i, demerit;
+
+	while(job->next < maskNum) {
+		i = job->next++;
+		Tcl_MutexUnlock(&maskPool.mutex);
+		demerit = Mask_evaluateMask(job->width, job->frame, job->patterns, i, job->level, mask, board);
+		Tcl_MutexLock(&maskPool.mutex);
+		job->demerit[i] = demerit;
+		if(++job->finished == maskNum) {
+			Tcl_ConditionNotify(&maskPool.done);
+		}
+	}
+	Mask_dequeueJob(job);
+}
+
+static Tcl_ThreadCreateType Mask_worker(ClientData clientData)
+{
+	MaskJob *job;
+	unsigned char *mask;
+	MaskBoard *board;
+
+	mask = (unsigned char *)malloc(QRSPEC_WIDTH_MAX * QRSPEC_WIDTH_MAX);
+	board = (MaskBoard *)malloc(sizeof(MaskBoard));
+
+	Tcl_MutexLock(&maskPool.mutex);
+	/* Without buffers the worker just leaves the jobs to the others. */
+	while(mask != NULL && board != NULL) {
+		while(maskPool.head == NULL && !maskPool.shutdown) {
+			Tcl_ConditionWait(&maskPool.work, &maskPool.mutex, NULL);
+		}
+		if(maskPool.shutdown) break;
+		job = maskPool.head;
+		if(++job->helpers >= job->threads - 1) {
+			Mask_dequeueJob(job);
+		}
+		Mask_runJob(job, mask, board);
+	}
+	Tcl_MutexUnlock(&maskPool.mutex);
+
+	free(mask);
+	free(board);
+
+	Tcl_ExitThread(0);
+	TCL_THREAD_CREATE_RETURN;
+}
+
+static void Mask_exitPool(ClientData clientData)
+{
+	int i, n, result;
+
+	Tcl_MutexLock(&maskPool.mutex);
+	maskPool.shutdown = 1;
+	n = maskPool.workers;
+	Tcl_ConditionNotify(&maskPool.work);
+	Tcl_MutexUnlock(&maskPool.mutex);
+
+	for(i = 0; i < n; i++) {
+		Tcl_JoinThread(maskPool.threads[i], &result);
+	}
+}
+
+/* Called with the pool mutex held. */
+static void Mask_growPool(int helpers)
+{
+	if(maskPool.shutdown) return;
+	if(maskPool.workers == 0 && helpers > 0) {
+		Tcl_CreateExitHandler(Mask_exitPool, NULL);
+	}
+	while(maskPool.workers < helpers) {
+		if(Tcl_CreateThread(&maskPool.threads[maskPool.workers], Mask_worker, NULL,
+				TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE) != TCL_OK) {
+			break;
+		}
+		maskPool.workers++;
+	}
+}
+
+static int Mask_selectParallel(int width, unsigned char *frame, unsigned char **patterns, QRecLevel level, unsigned char *mask, MaskBoard *board, int nthreads)
+{
+	MaskJob job;
+	int i;
+	int best = 0;
+
+	job.width = width;
+	job.frame = frame;
+	job.patterns = patterns;
+	job.level = level;
+	job.threads = nthreads;
+	job.helpers = 0;
+	job.next = 0;
+	job.finished = 0;
+	job.queued = 1;
+	job.nextJob = NULL;
+
+	Tcl_MutexLock(&maskPool.mutex);
+	Mask_growPool(nthreads - 1);
+	if(maskPool.tail != NULL) {
+		maskPool.tail->nextJob = &job;
+	} else {
+		maskPool.head = &job;
+	}
+	maskPool.tail = &job;
+	Tcl_ConditionNotify(&maskPool.work);
+
+	Mask_runJob(&job, mask, board);
+	while(job.finished < maskNum) {
+		Tcl_ConditionWait(&maskPool.done, &maskPool.mutex, NULL);
+	}
+	Tcl_MutexUnlock(&maskPool.mutex);
+
+	for(i = 1; i < maskNum; i++) {
+		if(job.demerit[i] < job.demerit[best]) {
+			best = i;
+		}
+	}
+
+	return best;
+}
+
 unsigned char *Mask_mask(int width, unsigned char *frame, QRecLevel level)
 {
 	int i;
 	unsigned char *mask, *bestMask;
+	unsigned char **patterns;
+	MaskBoard *board;
 	int minDemerit = INT_MAX;
-	int blacks;
-	int bratio;
+	int bestMaskNum = 0;
 	int demerit;
+	int version, threads;
 	int w2 = width * width;
+	Tcl_WideInt start;
 
-	mask = (unsigned char *)malloc(w2);
+	QRSTATS_START(start);
+
+	mask = (unsigned char *)QRarena_alloc(w2);
 	if(mask == NULL) return NULL;
 	bestMask = (unsigned char *)malloc(w2);
 	if(bestMask == NULL) {
-		free(mask);
+		QRarena_free(mask);
+		return NULL;
+	}
+	board = (MaskBoard *)QRarena_alloc(sizeof(MaskBoard));
+	if(board == NULL) {
+		QRarena_free(mask);
+		free(bestMask);
+		return NULL;
+	}
+	patterns = Mask_getPatterns(width, frame);
+	if(patterns == NULL) {
+		QRarena_free(board);
+		QRarena_free(mask);
+		free(bestMask);
 		return NULL;
 	}
 
-	for(i = 0; i < maskNum; i++) {
-//		n1 = n2 = n3 = n4 = 0;
-		demerit = 0;
-		blacks = maskMakers[i](width, frame, mask);
-		blacks += Mask_writeFormatInformation(width, mask, i, level);
-		bratio = (200 * blacks + w2) / w2 / 2; /* (int)(100*blacks/w2+0.5) */
-		demerit = (abs(bratio - 50) / 5) * N4;
-//		n4 = demerit;
-		demerit += Mask_evaluateSymbol(width, mask);
-//		printf("(%d,%d,%d,%d)=%d\n", n1, n2, n3 ,n4, demerit);
-		if(demerit < minDemerit) {
-			minDemerit = demerit;
-			memcpy(bestMask, mask, w2);
+	Mask_getParallel(&version, &threads);
+	if(threads > 1 && version > 0 && (width - 17) / 4 >= version
+			&& !*(int *)Tcl_GetThreadData(&Mask_serialKey, sizeof(int))) {
+		bestMaskNum = Mask_selectParallel(width, frame, patterns, level, mask, board, threads);
+		Mask_applyPattern(width, frame, patterns[bestMaskNum], bestMask);
+		Mask_writeFormatInformation(width, bestMask, bestMaskNum, level);
+	} else {
+		for(i = 0; i < maskNum; i++) {
+			demerit = Mask_evaluateMask(width, frame, patterns, i, level, mask, board);
+			if(demerit < minDemerit) {
+				minDemerit = demerit;
+				bestMaskNum = i;
+				memcpy(bestMask, mask, w2);
+			}
 		}
 	}
-	free(mask);
+	QRarena_free(board);
+	QRarena_free(mask);
+
+	QRSTATS_STOP(QRSTATS_MASK, start);
+	QRstats_countMask(0, bestMaskNum);
+
 	return bestMask;
 }
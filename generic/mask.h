@@ -24,6 +24,10 @@
 
 extern unsigned char *Mask_makeMask(int width, unsigned char *frame, int mask, QRecLevel level);
 extern unsigned char *Mask_mask(int width, unsigned char *frame, QRecLevel level);
+extern void Mask_setParallel(int version, int threads);
+extern void Mask_getParallel(int *version, int *threads);
+extern int Mask_setThreadParallel(int enabled);
+extern void Mask_clearCache(void);
 
 #ifdef WITH_TESTS
 extern int Mask_calcN2(int width, unsigned char *frame);
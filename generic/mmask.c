@@ -23,10 +23,13 @@
 #include <string.h>
 #include <limits.h>
 #include <errno.h>
+#include <stdint.h>
 
 #include "qrencode.h"
 #include "mqrspec.h"
 #include "mmask.h"
+#include "qrstats.h"
+#include "qratomic.h"
 
 void MMask_writeFormatInformation(int version, int width, unsigned char *frame, int mask, QRecLevel level)
 {
@@ -142,27 +145,110 @@ int MMask_evaluateSymbol(int width, unsigned char *frame)
 	return (sum1 <= sum2)?(sum1 * 16 + sum2):(sum2 * 16 + sum1);
 }
 
+/**
+ * Mask patterns, one byte per module, 1 where the mask flips a data
+ * module. See Mask_getPatterns().
+ */
+static unsigned char **maskPatterns[MQRSPEC_VERSION_MAX + 1];
+
+static unsigned char **MMask_getPatterns(int version, int width, const unsigned char *frame)
+{
+	int w2 = width * width;
+	unsigned char **patterns, **prev;
+	unsigned char *function, *p;
+	int i, j;
+
+	patterns = QRatomic_loadPtr(&maskPatterns[version]);
+	if(patterns != NULL) return patterns;
+
+	patterns = (unsigned char **)malloc(sizeof(unsigned char *) * maskNum + (size_t)w2 * maskNum);
+	function = (unsigned char *)malloc(w2);
+	if(patterns == NULL || function == NULL) {
+		free(patterns);
+		free(function);
+		errno = ENOMEM;
+		return NULL;
+	}
+	for(j = 0; j < w2; j++) {
+		function[j] = frame[j] & 0x80;
+	}
+	p = (unsigned char *)(patterns + maskNum);
+	for(i = 0; i < maskNum; i++) {
+		patterns[i] = p;
+		maskMakers[i](width, function, p);
+		for(j = 0; j < w2; j++) {
+			p[j] &= 1;
+		}
+		p += w2;
+	}
+	free(function);
+
+	prev = QRatomic_publishPtr(&maskPatterns[version], patterns);
+	if(prev != NULL) {
+		free(patterns);
+		patterns = prev;
+	}
+
+	return patterns;
+}
+
+void MMask_clearCache(void)
+{
+	int i;
+
+	for(i = 1; i <= MQRSPEC_VERSION_MAX; i++) {
+		free(QRatomic_exchangePtr(&maskPatterns[i], NULL));
+	}
+}
+
+/* Same as maskMakers[], eight modules at a time. */
+static void MMask_applyPattern(int width, const unsigned char *s, const unsigned char *pattern, unsigned char *d)
+{
+	int i;
+	int w2 = width * width;
+	uint64_t src, bits;
+
+	for(i = 0; i + 8 <= w2; i += 8) {
+		memcpy(&src, s + i, 8);
+		memcpy(&bits, pattern + i, 8);
+		src ^= bits;
+		memcpy(d + i, &src, 8);
+	}
+	for(; i < w2; i++) {
+		d[i] = s[i] ^ pattern[i];
+	}
+}
+
 unsigned char *MMask_mask(int version, unsigned char *frame, QRecLevel level)
 {
 	int i;
 	unsigned char *mask, *bestMask;
+	unsigned char **patterns;
 	int maxScore = 0;
+	int bestMaskNum = 0;
 	int score;
 	int width;
+	Tcl_WideInt start;
+
+	QRSTATS_START(start);
 
 	width = MQRspec_getWidth(version);
 
+	patterns = MMask_getPatterns(version, width, frame);
+	if(patterns == NULL) return NULL;
+
 	mask = (unsigned char *)malloc(width * width);
 	if(mask == NULL) return NULL;
 	bestMask = NULL;
 
 	for(i = 0; i < maskNum; i++) {
 		score = 0;
-		maskMakers[i](width, frame, mask);
+		MMask_applyPattern(width, frame, patterns[i], mask);
 		MMask_writeFormatInformation(version, width, mask, i, level);
 		score = MMask_evaluateSymbol(width, mask);
 		if(score > maxScore) {
 			maxScore = score;
+			bestMaskNum = i;
 			free(bestMask);
 			bestMask = mask;
 			mask = (unsigned char *)malloc(width * width);
@@ -170,5 +256,9 @@ unsigned char *MMask_mask(int version, unsigned char *frame, QRecLevel level)
 		}
 	}
 	free(mask);
+
+	QRSTATS_STOP(QRSTATS_MASK, start);
+	QRstats_countMask(1, bestMaskNum);
+
 	return bestMask;
 }
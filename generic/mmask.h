@@ -24,6 +24,7 @@
 
 extern unsigned char *MMask_makeMask(int version, unsigned char *frame, int mask, QRecLevel level);
 extern unsigned char *MMask_mask(int version, unsigned char *frame, QRecLevel level);
+extern void MMask_clearCache(void);
 
 #ifdef WITH_TESTS
 extern int MMask_evaluateSymbol(int width, unsigned char *frame);
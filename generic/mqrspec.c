@@ -35,6 +35,7 @@
 #include <tcl.h>
 
 #include "mqrspec.h"
+#include "qrarena.h"
 
 /******************************************************************************
  * Version and capacity
@@ -258,7 +259,7 @@ unsigned char *MQRspec_newFrame(int version)
 	if(frames[version] == NULL) return NULL;
 
 	width = mqrspecCapacity[version].width;
-	frame = (unsigned char *)malloc(width * width);
+	frame = (unsigned char *)QRarena_alloc(width * width);
 	if(frame == NULL) return NULL;
 	memcpy(frame, frames[version], width * width);
 
@@ -131,10 +131,15 @@ extern unsigned int MQRspec_getFormatInfo(int mask, int version, QRecLevel level
 /**
  * Return a copy of initialized frame.
  * @param version version of the symbol
- * @return Array of unsigned char. You can free it by free().
+ * @return Array of unsigned char. You can free it by QRarena_free().
  */
 extern unsigned char *MQRspec_newFrame(int version);
 
+/**
+ * Free the cached frames.
+ */
+extern void MQRspec_clearCache(void);
+
 /******************************************************************************
  * Mode indicator
  *****************************************************************************/
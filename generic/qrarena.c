@@ -0,0 +1,227 @@
+/*
+ * qrencode - QR Code encoder
+ *
+ * Per-encode arena allocator.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <tcl.h>
+
+#include "qrarena.h"
+#include "qratomic.h"
+
+long QRarena_enabled = 1;
+
+/* Allocations are aligned to, and prefixed by a header of, ALIGNMENT. */
+#define ALIGNMENT (16)
+#define ALIGN(__size__) (((__size__) + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1))
+
+#define CHUNK_SIZE (64 * 1024)
+/* Chunks kept per thread between encodes. */
+#define RETAIN_SIZE (1024 * 1024)
+
+typedef struct QRarenaChunk {
+	struct QRarenaChunk *next;
+	unsigned char *data;
+	size_t size;
+	size_t used;
+	size_t last;	///< offset of the latest allocation
+} QRarenaChunk;
+
+typedef struct {
+	int depth;
+	int exitHandler;
+	QRarenaChunk *chunks;
+} QRarena;
+
+static Tcl_ThreadDataKey dataKey;
+
+static void QRarena_freeChunks(QRarenaChunk *chunk)
+{
+	QRarenaChunk *next;
+
+	while(chunk != NULL) {
+		next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+}
+
+static void QRarena_exit(ClientData clientData)
+{
+	QRarena *arena = (QRarena *)clientData;
+
+	QRarena_freeChunks(arena->chunks);
+	arena->chunks = NULL;
+}
+
+static QRarena *QRarena_current(void)
+{
+	QRarena *arena;
+
+	arena = (QRarena *)Tcl_GetThreadData(&dataKey, sizeof(QRarena));
+	if(!arena->exitHandler) {
+		Tcl_CreateThreadExitHandler(QRarena_exit, (ClientData) arena);
+		arena->exitHandler = 1;
+	}
+
+	return arena;
+}
+
+static QRarenaChunk *QRarena_findChunk(QRarena *arena, const void *ptr)
+{
+	QRarenaChunk *chunk;
+	const unsigned char *p = (const unsigned char *)ptr;
+
+	for(chunk = arena->chunks; chunk != NULL; chunk = chunk->next) {
+		if(p >= chunk->data && p < chunk->data + chunk->size) return chunk;
+	}
+
+	return NULL;
+}
+
+int QRarena_begin(void)
+{
+	if(!QRatomic_loadLong(&QRarena_enabled)) return 0;
+
+	QRarena_current()->depth++;
+
+	return 1;
+}
+
+void QRarena_end(int scope)
+{
+	QRarena *arena;
+	QRarenaChunk *chunk, **prev;
+	size_t retained = 0;
+
+	if(!scope) return;
+
+	arena = QRarena_current();
+	if(--arena->depth > 0) return;
+
+	prev = &arena->chunks;
+	while((chunk = *prev) != NULL) {
+		if(retained + chunk->size > RETAIN_SIZE) {
+			*prev = chunk->next;
+			free(chunk);
+		} else {
+			retained += chunk->size;
+			chunk->used = 0;
+			chunk->last = 0;
+			prev = &chunk->next;
+		}
+	}
+}
+
+void *QRarena_alloc(size_t size)
+{
+	QRarena *arena;
+	QRarenaChunk *chunk;
+	size_t need, chunkSize;
+	unsigned char *p;
+
+	arena = QRarena_current();
+	if(arena->depth == 0) return malloc(size);
+
+	need = ALIGNMENT + ALIGN(size);
+	for(chunk = arena->chunks; chunk != NULL; chunk = chunk->next) {
+		if(chunk->size - chunk->used >= need) break;
+	}
+	if(chunk == NULL) {
+		chunkSize = (need > CHUNK_SIZE) ? need : CHUNK_SIZE;
+		chunk = (QRarenaChunk *)malloc(ALIGN(sizeof(QRarenaChunk)) + chunkSize);
+		if(chunk == NULL) return NULL;
+		chunk->data = (unsigned char *)chunk + ALIGN(sizeof(QRarenaChunk));
+		chunk->size = chunkSize;
+		chunk->used = 0;
+		chunk->last = 0;
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+	}
+
+	p = chunk->data + chunk->used;
+	*(size_t *)p = size;
+	chunk->last = chunk->used;
+	chunk->used += need;
+
+	return p + ALIGNMENT;
+}
+
+void *QRarena_calloc(size_t nmemb, size_t size)
+{
+	void *ptr;
+
+	ptr = QRarena_alloc(nmemb * size);
+	if(ptr != NULL) {
+		memset(ptr, 0, nmemb * size);
+	}
+
+	return ptr;
+}
+
+void *QRarena_realloc(void *ptr, size_t size)
+{
+	QRarena *arena;
+	QRarenaChunk *chunk;
+	unsigned char *p;
+	size_t oldSize;
+	void *newPtr;
+
+	if(ptr == NULL) return QRarena_alloc(size);
+
+	arena = QRarena_current();
+	chunk = QRarena_findChunk(arena, ptr);
+	if(chunk == NULL) return realloc(ptr, size);
+
+	p = (unsigned char *)ptr - ALIGNMENT;
+	oldSize = *(size_t *)p;
+	/* The latest allocation grows in place. */
+	if(p == chunk->data + chunk->last && chunk->last + ALIGNMENT + ALIGN(size) <= chunk->size) {
+		*(size_t *)p = size;
+		chunk->used = chunk->last + ALIGNMENT + ALIGN(size);
+		return ptr;
+	}
+
+	newPtr = QRarena_alloc(size);
+	if(newPtr == NULL) return NULL;
+	memcpy(newPtr, ptr, (oldSize < size) ? oldSize : size);
+	QRarena_free(ptr);
+
+	return newPtr;
+}
+
+void QRarena_free(void *ptr)
+{
+	QRarena *arena;
+	QRarenaChunk *chunk;
+
+	if(ptr == NULL) return;
+
+	arena = QRarena_current();
+	chunk = QRarena_findChunk(arena, ptr);
+	if(chunk == NULL) {
+		free(ptr);
+		return;
+	}
+
+	/* Only the latest allocation is given back before the scope ends. */
+	if((unsigned char *)ptr - ALIGNMENT == chunk->data + chunk->last && chunk->used > 0) {
+		chunk->used = chunk->last;
+	}
+}
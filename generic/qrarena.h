@@ -0,0 +1,48 @@
+/*
+ * qrencode - QR Code encoder
+ *
+ * Per-encode arena allocator.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef QRARENA_H
+#define QRARENA_H
+
+#include <stddef.h>
+
+/*
+ * Between QRarena_begin() and the matching QRarena_end() the intermediate
+ * buffers of an encode are bump-allocated from chunks owned by the calling
+ * thread. QRarena_end() of the outermost scope releases all of them at
+ * once and keeps the chunks for the next encode of that thread. Outside a
+ * scope, or when QRarena_enabled is cleared, the functions fall back to
+ * malloc() and friends, and QRarena_free() accepts either kind of pointer.
+ *
+ * Nothing allocated in a scope may be used after it ends, so only buffers
+ * that the encoding owns may come from the arena; the QRcode handed to the
+ * caller never does. QRarena_enabled is shared by all threads and is only
+ * accessed through QRatomic_loadLong() and QRatomic_storeLong().
+ */
+extern long QRarena_enabled;
+
+extern int QRarena_begin(void);
+extern void QRarena_end(int scope);
+extern void *QRarena_alloc(size_t size);
+extern void *QRarena_calloc(size_t nmemb, size_t size);
+extern void *QRarena_realloc(void *ptr, size_t size);
+extern void QRarena_free(void *ptr);
+
+#endif /* QRARENA_H */
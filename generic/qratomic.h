@@ -0,0 +1,122 @@
+/*
+ * qrencode - QR Code encoder
+ *
+ * Atomic operations on shared tables and counters.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef QRATOMIC_H
+#define QRATOMIC_H
+
+#include <stddef.h>
+#include <tcl.h>
+
+/*
+ * Tables that are built once and only read afterwards are published like
+ * the frames of QRspec_newFrame(): readers load the pointer with acquire
+ * semantics and never wait for a lock, a builder stores it with
+ * QRatomic_publishPtr(), which only succeeds if the slot is still empty
+ * and returns NULL then, or the table of the thread that won the race,
+ * in which case the builder frees its own copy.
+ *
+ * The Long operations work on long counters and flags, the Wide ones on
+ * Tcl_WideInt sizes. Compilers without atomics fall back to a mutex.
+ */
+#if defined(__GNUC__)
+#define QRatomic_loadPtr(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define QRatomic_publishPtr(ptr, value) __sync_val_compare_and_swap((ptr), NULL, (value))
+#define QRatomic_exchangePtr(ptr, value) __atomic_exchange_n((ptr), (value), __ATOMIC_ACQ_REL)
+#define QRatomic_loadLong(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define QRatomic_storeLong(ptr, value) __atomic_store_n((ptr), (value), __ATOMIC_RELEASE)
+#define QRatomic_incrementLong(ptr) __atomic_add_fetch((ptr), 1, __ATOMIC_ACQ_REL)
+#define QRatomic_decrementLong(ptr) __atomic_sub_fetch((ptr), 1, __ATOMIC_ACQ_REL)
+#define QRatomic_loadWide(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define QRatomic_storeWide(ptr, value) __atomic_store_n((ptr), (value), __ATOMIC_RELEASE)
+#define QRatomic_addWide(ptr, value) __atomic_add_fetch((ptr), (value), __ATOMIC_ACQ_REL)
+#elif defined(_MSC_VER)
+#include <intrin.h>
+#define QRatomic_loadPtr(ptr) _InterlockedCompareExchangePointer((void *volatile *)(ptr), NULL, NULL)
+#define QRatomic_publishPtr(ptr, value) _InterlockedCompareExchangePointer((void *volatile *)(ptr), (value), NULL)
+#define QRatomic_exchangePtr(ptr, value) _InterlockedExchangePointer((void *volatile *)(ptr), (value))
+#define QRatomic_loadLong(ptr) _InterlockedCompareExchange((volatile long *)(ptr), 0, 0)
+#define QRatomic_storeLong(ptr, value) ((void)_InterlockedExchange((volatile long *)(ptr), (value)))
+#define QRatomic_incrementLong(ptr) _InterlockedIncrement((volatile long *)(ptr))
+#define QRatomic_decrementLong(ptr) _InterlockedDecrement((volatile long *)(ptr))
+#define QRatomic_loadWide(ptr) _InterlockedCompareExchange64((volatile __int64 *)(ptr), 0, 0)
+#define QRatomic_storeWide(ptr, value) ((void)_InterlockedExchange64((volatile __int64 *)(ptr), (value)))
+#define QRatomic_addWide(ptr, value) (_InterlockedExchangeAdd64((volatile __int64 *)(ptr), (value)) + (value))
+#else
+TCL_DECLARE_MUTEX(QRatomic_mutex)
+
+static void *QRatomic_lockedPtr(void **ptr, void *value, int mode)
+{
+	void *prev;
+
+	Tcl_MutexLock(&QRatomic_mutex);
+	prev = *ptr;
+	if(mode == 2 || (mode == 1 && prev == NULL)) {
+		*ptr = value;
+	}
+	Tcl_MutexUnlock(&QRatomic_mutex);
+
+	return prev;
+}
+
+static long QRatomic_lockedLong(long *ptr, long value, int mode)
+{
+	long result;
+
+	Tcl_MutexLock(&QRatomic_mutex);
+	if(mode == 1) {
+		*ptr = value;
+	} else if(mode == 2) {
+		*ptr += value;
+	}
+	result = *ptr;
+	Tcl_MutexUnlock(&QRatomic_mutex);
+
+	return result;
+}
+
+static Tcl_WideInt QRatomic_lockedWide(Tcl_WideInt *ptr, Tcl_WideInt value, int mode)
+{
+	Tcl_WideInt result;
+
+	Tcl_MutexLock(&QRatomic_mutex);
+	if(mode == 1) {
+		*ptr = value;
+	} else if(mode == 2) {
+		*ptr += value;
+	}
+	result = *ptr;
+	Tcl_MutexUnlock(&QRatomic_mutex);
+
+	return result;
+}
+
+#define QRatomic_loadPtr(ptr) QRatomic_lockedPtr((void **)(ptr), NULL, 0)
+#define QRatomic_publishPtr(ptr, value) QRatomic_lockedPtr((void **)(ptr), (value), 1)
+#define QRatomic_exchangePtr(ptr, value) QRatomic_lockedPtr((void **)(ptr), (value), 2)
+#define QRatomic_loadLong(ptr) QRatomic_lockedLong((ptr), 0, 0)
+#define QRatomic_storeLong(ptr, value) ((void)QRatomic_lockedLong((ptr), (value), 1))
+#define QRatomic_incrementLong(ptr) QRatomic_lockedLong((ptr), 1, 2)
+#define QRatomic_decrementLong(ptr) QRatomic_lockedLong((ptr), -1, 2)
+#define QRatomic_loadWide(ptr) QRatomic_lockedWide((ptr), 0, 0)
+#define QRatomic_storeWide(ptr, value) ((void)QRatomic_lockedWide((ptr), (value), 1))
+#define QRatomic_addWide(ptr, value) QRatomic_lockedWide((ptr), (value), 2)
+#endif
+
+#endif /* QRATOMIC_H */
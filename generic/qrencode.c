@@ -32,6 +32,9 @@
 #include "split.h"
 #include "mask.h"
 #include "mmask.h"
+#include "qrstats.h"
+#include "qrarena.h"
+#include "qratomic.h"
 
 #define MAJOR_VERSION  4
 #define MINOR_VERSION  0
@@ -58,6 +61,7 @@ typedef struct {
 	int b1;
 	int blocks;
 	RSblock *rsblock;
+	const int *interleave;
 	int count;
 } QRRawCode;
 
@@ -105,18 +109,84 @@ static int RSblock_init(RSblock *blocks, int spec[5], unsigned char *data, unsig
 	return 0;
 }
 
+/**
+ * Interleaving order. interleaves[version][level] maps the n-th codeword of
+ * the symbol to its offset in datacode (n < dataLength) or in ecccode, so
+ * that interleaving the RS blocks is a gather. Built on first use and
+ * published without a lock, see qratomic.h.
+ */
+static int *interleaves[QRSPEC_VERSION_MAX + 1][QR_ECLEVEL_H + 1];
+
+static const int *QRraw_getInterleave(int version, QRecLevel level, int spec[5])
+{
+	int *order, *prev;
+	int i, row, col;
+	int blocks = QRspec_rsBlockNum(spec);
+	int b1 = QRspec_rsBlockNum1(spec);
+	int dl1 = QRspec_rsDataCodes1(spec);
+	int dl2 = QRspec_rsDataCodes2(spec);
+	int el = QRspec_rsEccCodes1(spec);
+	int dataLength = QRspec_rsDataLength(spec);
+	int eccLength = QRspec_rsEccLength(spec);
+
+	order = QRatomic_loadPtr(&interleaves[version][level]);
+	if(order != NULL) return order;
+
+	order = (int *)malloc(sizeof(int) * (dataLength + eccLength));
+	if(order == NULL) return NULL;
+	for(i = 0; i < dataLength; i++) {
+		row = i % blocks;
+		col = i / blocks;
+		if(col >= dl1) {
+			row += b1;
+		}
+		if(row < b1) {
+			order[i] = row * dl1 + col;
+		} else {
+			order[i] = b1 * dl1 + (row - b1) * dl2 + col;
+		}
+	}
+	for(i = 0; i < eccLength; i++) {
+		row = i % blocks;
+		col = i / blocks;
+		order[dataLength + i] = row * el + col;
+	}
+
+	prev = QRatomic_publishPtr(&interleaves[version][level], order);
+	if(prev != NULL) {
+		free(order);
+		order = prev;
+	}
+
+	return order;
+}
+
+static void QRraw_clearCache(void)
+{
+	int i, j;
+
+	for(i = 1; i <= QRSPEC_VERSION_MAX; i++) {
+		for(j = 0; j <= QR_ECLEVEL_H; j++) {
+			free(QRatomic_exchangePtr(&interleaves[i][j], NULL));
+		}
+	}
+}
+
 void QRraw_free(QRRawCode *raw);
 QRRawCode *QRraw_new(QRinput *input)
 {
 	QRRawCode *raw;
 	int spec[5], ret;
+	Tcl_WideInt start;
 
-	raw = (QRRawCode *)malloc(sizeof(QRRawCode));
+	raw = (QRRawCode *)QRarena_alloc(sizeof(QRRawCode));
 	if(raw == NULL) return NULL;
 
+	QRSTATS_START(start);
 	raw->datacode = QRinput_getByteStream(input);
+	QRSTATS_STOP(QRSTATS_BITSTREAM, start);
 	if(raw->datacode == NULL) {
-		free(raw);
+		QRarena_free(raw);
 		return NULL;
 	}
 
@@ -126,24 +196,31 @@ QRRawCode *QRraw_new(QRinput *input)
 	raw->b1 = QRspec_rsBlockNum1(spec);
 	raw->dataLength = QRspec_rsDataLength(spec);
 	raw->eccLength = QRspec_rsEccLength(spec);
-	raw->ecccode = (unsigned char *)malloc(raw->eccLength);
+	raw->ecccode = (unsigned char *)QRarena_alloc(raw->eccLength);
 	if(raw->ecccode == NULL) {
-		free(raw->datacode);
-		free(raw);
+		QRarena_free(raw->datacode);
+		QRarena_free(raw);
 		return NULL;
 	}
 
 	raw->blocks = QRspec_rsBlockNum(spec);
-	raw->rsblock = (RSblock *)calloc(raw->blocks, sizeof(RSblock));
+	raw->rsblock = (RSblock *)QRarena_calloc(raw->blocks, sizeof(RSblock));
 	if(raw->rsblock == NULL) {
 		QRraw_free(raw);
 		return NULL;
 	}
+	QRSTATS_START(start);
 	ret = RSblock_init(raw->rsblock, spec, raw->datacode, raw->ecccode);
+	QRSTATS_STOP(QRSTATS_RSECC, start);
 	if(ret < 0) {
 		QRraw_free(raw);
 		return NULL;
 	}
+	raw->interleave = QRraw_getInterleave(raw->version, input->level, spec);
+	if(raw->interleave == NULL) {
+		QRraw_free(raw);
+		return NULL;
+	}
 
 	raw->count = 0;
 
@@ -158,20 +235,12 @@ QRRawCode *QRraw_new(QRinput *input)
  */
 unsigned char QRraw_getCode(QRRawCode *raw)
 {
-	int col, row;
 	unsigned char ret;
 
 	if(raw->count < raw->dataLength) {
-		row = raw->count % raw->blocks;
-		col = raw->count / raw->blocks;
-		if(col >= raw->rsblock[0].dataLength) {
-			row += raw->b1;
-		}
-		ret = raw->rsblock[row].data[col];
+		ret = raw->datacode[raw->interleave[raw->count]];
 	} else if(raw->count < raw->dataLength + raw->eccLength) {
-		row = (raw->count - raw->dataLength) % raw->blocks;
-		col = (raw->count - raw->dataLength) / raw->blocks;
-		ret = raw->rsblock[row].ecc[col];
+		ret = raw->ecccode[raw->interleave[raw->count]];
 	} else {
 		return 0;
 	}
@@ -182,10 +251,10 @@ unsigned char QRraw_getCode(QRRawCode *raw)
 void QRraw_free(QRRawCode *raw)
 {
 	if(raw != NULL) {
-		free(raw->datacode);
-		free(raw->ecccode);
-		free(raw->rsblock);
-		free(raw);
+		QRarena_free(raw->datacode);
+		QRarena_free(raw->ecccode);
+		QRarena_free(raw->rsblock);
+		QRarena_free(raw);
 	}
 }
 
@@ -208,33 +277,38 @@ void MQRraw_free(MQRRawCode *raw);
 MQRRawCode *MQRraw_new(QRinput *input)
 {
 	MQRRawCode *raw;
+	Tcl_WideInt start;
 
-	raw = (MQRRawCode *)malloc(sizeof(MQRRawCode));
+	raw = (MQRRawCode *)QRarena_alloc(sizeof(MQRRawCode));
 	if(raw == NULL) return NULL;
 
 	raw->version = input->version;
 	raw->dataLength = MQRspec_getDataLength(input->version, input->level);
 	raw->eccLength = MQRspec_getECCLength(input->version, input->level);
 	raw->oddbits = raw->dataLength * 8 - MQRspec_getDataLengthBit(input->version, input->level);
+	QRSTATS_START(start);
 	raw->datacode = QRinput_getByteStream(input);
+	QRSTATS_STOP(QRSTATS_BITSTREAM, start);
 	if(raw->datacode == NULL) {
-		free(raw);
+		QRarena_free(raw);
 		return NULL;
 	}
-	raw->ecccode = (unsigned char *)malloc(raw->eccLength);
+	raw->ecccode = (unsigned char *)QRarena_alloc(raw->eccLength);
 	if(raw->ecccode == NULL) {
-		free(raw->datacode);
-		free(raw);
+		QRarena_free(raw->datacode);
+		QRarena_free(raw);
 		return NULL;
 	}
 
-	raw->rsblock = (RSblock *)calloc(1, sizeof(RSblock));
+	raw->rsblock = (RSblock *)QRarena_calloc(1, sizeof(RSblock));
 	if(raw->rsblock == NULL) {
 		MQRraw_free(raw);
 		return NULL;
 	}
 
+	QRSTATS_START(start);
 	RSblock_initBlock(raw->rsblock, raw->dataLength, raw->datacode, raw->eccLength, raw->ecccode);
+	QRSTATS_STOP(QRSTATS_RSECC, start);
 
 	raw->count = 0;
 
@@ -265,10 +339,10 @@ unsigned char MQRraw_getCode(MQRRawCode *raw)
 void MQRraw_free(MQRRawCode *raw)
 {
 	if(raw != NULL) {
-		free(raw->datacode);
-		free(raw->ecccode);
-		free(raw->rsblock);
-		free(raw);
+		QRarena_free(raw->datacode);
+		QRarena_free(raw->ecccode);
+		QRarena_free(raw->rsblock);
+		QRarena_free(raw);
 	}
 }
 
@@ -352,6 +426,65 @@ static unsigned char *FrameFiller_next(FrameFiller *filler)
 	return &p[y * w + x];
 }
 
+/**
+ * Placement order. The offsets of the data modules of a symbol, in the
+ * order FrameFiller_next() visits them, so that the codewords can be
+ * scattered into the frame by a plain indexed loop. Built from the first
+ * frame of each version and published without a lock like the frames
+ * themselves, with the offsets in the same block as the header.
+ */
+typedef struct {
+	int length;
+	int *offsets;
+} Placement;
+
+static Placement *placements[QRSPEC_VERSION_MAX + 1];
+static Placement *mqrPlacements[MQRSPEC_VERSION_MAX + 1];
+
+static const Placement *Placement_get(int version, int width, unsigned char *frame, int mqr)
+{
+	Placement **slot, *placement, *prev;
+	FrameFiller filler;
+	unsigned char *p;
+	int n = 0;
+
+	slot = mqr ? &mqrPlacements[version] : &placements[version];
+	placement = QRatomic_loadPtr(slot);
+	if(placement != NULL) return placement;
+
+	placement = (Placement *)malloc(sizeof(Placement) + sizeof(int) * width * width);
+	if(placement == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	placement->offsets = (int *)(placement + 1);
+	FrameFiller_set(&filler, width, frame, mqr);
+	while((p = FrameFiller_next(&filler)) != NULL) {
+		placement->offsets[n++] = (int)(p - frame);
+	}
+	placement->length = n;
+
+	prev = QRatomic_publishPtr(slot, placement);
+	if(prev != NULL) {
+		free(placement);
+		placement = prev;
+	}
+
+	return placement;
+}
+
+static void Placement_clearCache(void)
+{
+	int i;
+
+	for(i = 1; i <= QRSPEC_VERSION_MAX; i++) {
+		free(QRatomic_exchangePtr(&placements[i], NULL));
+	}
+	for(i = 1; i <= MQRSPEC_VERSION_MAX; i++) {
+		free(QRatomic_exchangePtr(&mqrPlacements[i], NULL));
+	}
+}
+
 #ifdef WITH_TESTS
 unsigned char *FrameFiller_test(int version)
 {
@@ -370,7 +503,7 @@ unsigned char *FrameFiller_test(int version)
 	for(i = 0; i < length; i++) {
 		p = FrameFiller_next(&filler);
 		if(p == NULL) {
-			free(frame);
+			QRarena_free(frame);
 			return NULL;
 		}
 		*p = (unsigned char)(i & 0x7f) | 0x80;
@@ -434,10 +567,12 @@ QRcode *QRcode_encodeMask(QRinput *input, int mask)
 {
 	int width, version;
 	QRRawCode *raw;
-	unsigned char *frame, *masked, *p, code, bit;
+	unsigned char *frame, *masked, code;
+	const Placement *placement;
+	const int *offsets;
 	int i, j;
 	QRcode *qrcode = NULL;
-	FrameFiller filler;
+	Tcl_WideInt start;
 
 	if(input->mqr) {
 		errno = EINVAL;
@@ -462,17 +597,26 @@ QRcode *QRcode_encodeMask(QRinput *input, int mask)
 		QRraw_free(raw);
 		return NULL;
 	}
-	FrameFiller_set(&filler, width, frame, 0);
+	placement = Placement_get(version, width, frame, 0);
+	if(placement == NULL) goto EXIT;
+	if((raw->dataLength + raw->eccLength) * 8 + QRspec_getRemainder(version) > placement->length) {
+		errno = EINVAL;
+		goto EXIT;
+	}
+	offsets = placement->offsets;
 
+	QRSTATS_START(start);
 	/* interleaved data and ecc codes */
-	for(i = 0; i < raw->dataLength + raw->eccLength; i++) {
-		code = QRraw_getCode(raw);
-		bit = 0x80;
-		for(j = 0; j < 8; j++) {
-			p = FrameFiller_next(&filler);
-			if(p == NULL)  goto EXIT;
-			*p = 0x02 | ((bit & code) != 0);
-			bit = bit >> 1;
+	for(i = 0; i < raw->dataLength; i++) {
+		code = raw->datacode[raw->interleave[i]];
+		for(j = 7; j >= 0; j--) {
+			frame[*offsets++] = 0x02 | ((code >> j) & 1);
+		}
+	}
+	for(; i < raw->dataLength + raw->eccLength; i++) {
+		code = raw->ecccode[raw->interleave[i]];
+		for(j = 7; j >= 0; j--) {
+			frame[*offsets++] = 0x02 | ((code >> j) & 1);
 		}
 	}
 	QRraw_free(raw);
@@ -480,10 +624,9 @@ QRcode *QRcode_encodeMask(QRinput *input, int mask)
 	/* remainder bits */
 	j = QRspec_getRemainder(version);
 	for(i = 0; i < j; i++) {
-		p = FrameFiller_next(&filler);
-		if(p == NULL)  goto EXIT;
-		*p = 0x02;
+		frame[*offsets++] = 0x02;
 	}
+	QRSTATS_STOP(QRSTATS_FILL, start);
 
 	/* masking */
 	if(mask == -2) { // just for debug purpose
@@ -504,7 +647,7 @@ QRcode *QRcode_encodeMask(QRinput *input, int mask)
 
 EXIT:
 	QRraw_free(raw);
-	free(frame);
+	QRarena_free(frame);
 	return qrcode;
 }
 
@@ -512,10 +655,12 @@ QRcode *QRcode_encodeMaskMQR(QRinput *input, int mask)
 {
 	int width, version;
 	MQRRawCode *raw;
-	unsigned char *frame, *masked, *p, code, bit;
+	unsigned char *frame, *masked, code;
+	const Placement *placement;
+	const int *offsets;
 	int i, j, length;
 	QRcode *qrcode = NULL;
-	FrameFiller filler;
+	Tcl_WideInt start;
 
 	if(!input->mqr) {
 		errno = EINVAL;
@@ -540,26 +685,33 @@ QRcode *QRcode_encodeMaskMQR(QRinput *input, int mask)
 		MQRraw_free(raw);
 		return NULL;
 	}
-	FrameFiller_set(&filler, width, frame, 1);
+	placement = Placement_get(version, width, frame, 1);
+	if(placement == NULL) goto EXIT;
+	length = (raw->dataLength + raw->eccLength) * 8;
+	if(raw->oddbits) length -= 8 - raw->oddbits;
+	if(length > placement->length) {
+		errno = EINVAL;
+		goto EXIT;
+	}
+	offsets = placement->offsets;
 
+	QRSTATS_START(start);
 	/* interleaved data and ecc codes */
 	for(i = 0; i < raw->dataLength + raw->eccLength; i++) {
-		code = MQRraw_getCode(raw);
-		bit = 0x80;
+		/* a single RS block, so no interleaving */
+		code = (i < raw->dataLength) ? raw->datacode[i] : raw->ecccode[i - raw->dataLength];
 		if(raw->oddbits && i == raw->dataLength - 1) {
 			length = raw->oddbits;
 		} else {
 			length = 8;
 		}
-		for(j = 0; j < length; j++) {
-			p = FrameFiller_next(&filler);
-			if(p == NULL) goto EXIT;
-			*p = 0x02 | ((bit & code) != 0);
-			bit = bit >> 1;
+		for(j = 7; j >= 8 - length; j--) {
+			frame[*offsets++] = 0x02 | ((code >> j) & 1);
 		}
 	}
 	MQRraw_free(raw);
 	raw = NULL;
+	QRSTATS_STOP(QRSTATS_FILL, start);
 
 	/* masking */
 	if(mask == -2) { // just for debug purpose
@@ -581,7 +733,7 @@ QRcode *QRcode_encodeMaskMQR(QRinput *input, int mask)
 
 EXIT:
 	MQRraw_free(raw);
-	free(frame);
+	QRarena_free(frame);
 	return qrcode;
 }
 
@@ -594,11 +746,12 @@ QRcode *QRcode_encodeInput(QRinput *input)
 	}
 }
 
-static QRcode *QRcode_encodeStringReal(const char *string, int version, QRecLevel level, int mqr, QRencodeMode hint, int casesensitive)
+static QRcode *QRcode_encodeStringReal(const char *string, int version, QRecLevel level, int mqr, QRencodeMode hint, int casesensitive, int optimal)
 {
 	QRinput *input;
 	QRcode *code;
-	int ret;
+	int ret, scope;
+	Tcl_WideInt start;
 
 	if(string == NULL) {
 		errno = EINVAL;
@@ -609,59 +762,82 @@ static QRcode *QRcode_encodeStringReal(const char *string, int version, QRecLeve
 		return NULL;
 	}
 
+	scope = QRarena_begin();
 	if(mqr) {
 		input = QRinput_newMQR(version, level);
 	} else {
 		input = QRinput_new2(version, level);
 	}
-	if(input == NULL) return NULL;
+	if(input == NULL) {
+		QRarena_end(scope);
+		return NULL;
+	}
 
-	ret = Split_splitStringToQRinput(string, input, hint, casesensitive);
+	QRSTATS_START(start);
+	if(optimal) {
+		ret = Split_splitStringToQRinputOptimal(string, input, hint, casesensitive);
+	} else {
+		ret = Split_splitStringToQRinput(string, input, hint, casesensitive);
+	}
+	QRSTATS_STOP(QRSTATS_SPLIT, start);
 	if(ret < 0) {
 		QRinput_free(input);
+		QRarena_end(scope);
 		return NULL;
 	}
 	code = QRcode_encodeInput(input);
 	QRinput_free(input);
+	QRarena_end(scope);
 
 	return code;
 }
 
 QRcode *QRcode_encodeString(const char *string, int version, QRecLevel level, QRencodeMode hint, int casesensitive)
 {
-	return QRcode_encodeStringReal(string, version, level, 0, hint, casesensitive);
+	return QRcode_encodeStringReal(string, version, level, 0, hint, casesensitive, 0);
+}
+
+QRcode *QRcode_encodeStringOptimal(const char *string, int version, QRecLevel level, QRencodeMode hint, int casesensitive)
+{
+	return QRcode_encodeStringReal(string, version, level, 0, hint, casesensitive, 1);
 }
 
 QRcode *QRcode_encodeStringMQR(const char *string, int version, QRecLevel level, QRencodeMode hint, int casesensitive)
 {
-	return QRcode_encodeStringReal(string, version, level, 1, hint, casesensitive);
+	return QRcode_encodeStringReal(string, version, level, 1, hint, casesensitive, 0);
 }
 
 static QRcode *QRcode_encodeDataReal(const unsigned char *data, int length, int version, QRecLevel level, int mqr)
 {
 	QRinput *input;
 	QRcode *code;
-	int ret;
+	int ret, scope;
 
 	if(data == NULL || length == 0) {
 		errno = EINVAL;
 		return NULL;
 	}
 
+	scope = QRarena_begin();
 	if(mqr) {
 		input = QRinput_newMQR(version, level);
 	} else {
 		input = QRinput_new2(version, level);
 	}
-	if(input == NULL) return NULL;
+	if(input == NULL) {
+		QRarena_end(scope);
+		return NULL;
+	}
 
 	ret = QRinput_append(input, QR_MODE_8, length, data);
 	if(ret < 0) {
 		QRinput_free(input);
+		QRarena_end(scope);
 		return NULL;
 	}
 	code = QRcode_encodeInput(input);
 	QRinput_free(input);
+	QRarena_end(scope);
 
 	return code;
 }
@@ -695,6 +871,156 @@ QRcode *QRcode_encodeString8bitMQR(const char *string, int version, QRecLevel le
 }
 
 
+/******************************************************************************
+ * Measurement
+ *****************************************************************************/
+
+int QRcode_measureInput(QRinput *input, QRcode_Measure *measure)
+{
+	QRinput_List *list;
+	int version, next, bits, capacity;
+
+	if(input->fnc1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if(input->mqr) {
+		version = input->version;
+		/* Modes that the encoder rejects on small versions. */
+		for(list = input->head; list != NULL; list = list->next) {
+			if((version < 2 && (list->mode == QR_MODE_AN || list->mode == QR_MODE_KANJI))
+					|| (version < 3 && list->mode == QR_MODE_8)) {
+				errno = EINVAL;
+				return -1;
+			}
+		}
+		bits = QRinput_estimateBitStreamSize(input, version);
+		capacity = MQRspec_getDataLengthBit(version, input->level);
+		measure->width = MQRspec_getWidth(version);
+	} else {
+		/* Same steps as QRinput_convertData(), on estimated lengths. */
+		version = QRinput_estimateVersion(input);
+		if(version < input->version) {
+			version = input->version;
+		}
+		for(;;) {
+			bits = QRinput_estimateBitStreamSize(input, version);
+			next = QRspec_getMinimumVersion((bits + 7) / 8, input->level);
+			if(next <= version) break;
+			version = next;
+		}
+		capacity = QRspec_getDataLength(version, input->level) * 8;
+		measure->width = QRspec_getWidth(version);
+	}
+	if(bits > capacity) {
+		errno = ERANGE;
+		return -1;
+	}
+
+	measure->version = version;
+	measure->bits = bits;
+	measure->capacity = capacity;
+
+	return 0;
+}
+
+static int QRcode_measureStringReal(const char *string, int version, QRecLevel level, int mqr, QRencodeMode hint, int casesensitive, int optimal, QRcode_Measure *measure)
+{
+	QRinput *input;
+	int ret, scope;
+
+	if(string == NULL || measure == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if(hint != QR_MODE_8 && hint != QR_MODE_KANJI) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	scope = QRarena_begin();
+	if(mqr) {
+		input = QRinput_newMQR(version, level);
+	} else {
+		input = QRinput_new2(version, level);
+	}
+	if(input == NULL) {
+		QRarena_end(scope);
+		return -1;
+	}
+
+	if(optimal) {
+		ret = Split_splitStringToQRinputOptimal(string, input, hint, casesensitive);
+	} else {
+		ret = Split_splitStringToQRinput(string, input, hint, casesensitive);
+	}
+	if(ret == 0) {
+		ret = QRcode_measureInput(input, measure);
+	}
+	QRinput_free(input);
+	QRarena_end(scope);
+
+	return ret;
+}
+
+int QRcode_measureString(const char *string, int version, QRecLevel level, QRencodeMode hint, int casesensitive, QRcode_Measure *measure)
+{
+	return QRcode_measureStringReal(string, version, level, 0, hint, casesensitive, 0, measure);
+}
+
+int QRcode_measureStringOptimal(const char *string, int version, QRecLevel level, QRencodeMode hint, int casesensitive, QRcode_Measure *measure)
+{
+	return QRcode_measureStringReal(string, version, level, 0, hint, casesensitive, 1, measure);
+}
+
+int QRcode_measureStringMQR(const char *string, int version, QRecLevel level, QRencodeMode hint, int casesensitive, QRcode_Measure *measure)
+{
+	return QRcode_measureStringReal(string, version, level, 1, hint, casesensitive, 0, measure);
+}
+
+static int QRcode_measureDataReal(const unsigned char *data, int length, int version, QRecLevel level, int mqr, QRcode_Measure *measure)
+{
+	QRinput *input;
+	int ret, scope;
+
+	if(data == NULL || length == 0 || measure == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	scope = QRarena_begin();
+	if(mqr) {
+		input = QRinput_newMQR(version, level);
+	} else {
+		input = QRinput_new2(version, level);
+	}
+	if(input == NULL) {
+		QRarena_end(scope);
+		return -1;
+	}
+
+	ret = QRinput_append(input, QR_MODE_8, length, data);
+	if(ret == 0) {
+		ret = QRcode_measureInput(input, measure);
+	}
+	QRinput_free(input);
+	QRarena_end(scope);
+
+	return ret;
+}
+
+int QRcode_measureData(int size, const unsigned char *data, int version, QRecLevel level, QRcode_Measure *measure)
+{
+	return QRcode_measureDataReal(data, size, version, level, 0, measure);
+}
+
+int QRcode_measureDataMQR(int size, const unsigned char *data, int version, QRecLevel level, QRcode_Measure *measure)
+{
+	return QRcode_measureDataReal(data, size, version, level, 1, measure);
+}
+
+
 /******************************************************************************
  * Structured QR-code encoding
  *****************************************************************************/
@@ -807,11 +1133,12 @@ static QRcode_List *QRcode_encodeInputToStructured(QRinput *input)
 static QRcode_List *QRcode_encodeDataStructuredReal(
 	int size, const unsigned char *data,
 	int version, QRecLevel level,
-	int eightbit, QRencodeMode hint, int casesensitive)
+	int eightbit, QRencodeMode hint, int casesensitive, int optimal)
 {
 	QRinput *input;
 	QRcode_List *codes;
-	int ret;
+	int ret, scope;
+	Tcl_WideInt start;
 
 	if(version <= 0) {
 		errno = EINVAL;
@@ -822,26 +1149,38 @@ static QRcode_List *QRcode_encodeDataStructuredReal(
 		return NULL;
 	}
 
+	scope = QRarena_begin();
 	input = QRinput_new2(version, level);
-	if(input == NULL) return NULL;
+	if(input == NULL) {
+		QRarena_end(scope);
+		return NULL;
+	}
 
 	if(eightbit) {
 		ret = QRinput_append(input, QR_MODE_8, size, data);
 	} else {
-		ret = Split_splitStringToQRinput((char *)data, input, hint, casesensitive);
+		QRSTATS_START(start);
+		if(optimal) {
+			ret = Split_splitStringToQRinputOptimal((char *)data, input, hint, casesensitive);
+		} else {
+			ret = Split_splitStringToQRinput((char *)data, input, hint, casesensitive);
+		}
+		QRSTATS_STOP(QRSTATS_SPLIT, start);
 	}
 	if(ret < 0) {
 		QRinput_free(input);
+		QRarena_end(scope);
 		return NULL;
 	}
 	codes = QRcode_encodeInputToStructured(input);
 	QRinput_free(input);
+	QRarena_end(scope);
 
 	return codes;
 }
 
 QRcode_List *QRcode_encodeDataStructured(int size, const unsigned char *data, int version, QRecLevel level) {
-	return QRcode_encodeDataStructuredReal(size, data, version, level, 1, QR_MODE_NUL, 0);
+	return QRcode_encodeDataStructuredReal(size, data, version, level, 1, QR_MODE_NUL, 0, 0);
 }
 
 QRcode_List *QRcode_encodeString8bitStructured(const char *string, int version, QRecLevel level) {
@@ -858,7 +1197,16 @@ QRcode_List *QRcode_encodeStringStructured(const char *string, int version, QRec
 		errno = EINVAL;
 		return NULL;
 	}
-	return QRcode_encodeDataStructuredReal(strlen(string), (unsigned char *)string, version, level, 0, hint, casesensitive);
+	return QRcode_encodeDataStructuredReal(strlen(string), (unsigned char *)string, version, level, 0, hint, casesensitive, 0);
+}
+
+QRcode_List *QRcode_encodeStringStructuredOptimal(const char *string, int version, QRecLevel level, QRencodeMode hint, int casesensitive)
+{
+	if(string == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+	return QRcode_encodeDataStructuredReal(strlen(string), (unsigned char *)string, version, level, 0, hint, casesensitive, 1);
 }
 
 /******************************************************************************
@@ -885,5 +1233,10 @@ char *QRcode_APIVersionString(void)
 
 void QRcode_clearCache(void)
 {
-	return;
+	QRraw_clearCache();
+	Placement_clearCache();
+	QRspec_clearCache();
+	MQRspec_clearCache();
+	Mask_clearCache();
+	MMask_clearCache();
 }
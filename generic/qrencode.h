@@ -378,6 +378,16 @@ typedef struct {
 	unsigned char *data; ///< symbol data
 } QRcode;
 
+/**
+ * Size of the symbol that some input data needs, see QRcode_measureInput().
+ */
+typedef struct {
+	int version;         ///< version of the symbol
+	int width;           ///< width of the symbol
+	int bits;            ///< length of the encoded data in bits
+	int capacity;        ///< number of data bits the symbol holds
+} QRcode_Measure;
+
 /**
  * Singly-linked list of QRcode. Used to represent a structured symbols.
  * A list is terminated with NULL.
@@ -425,6 +435,13 @@ extern QRcode *QRcode_encodeInput(QRinput *input);
  */
 extern QRcode *QRcode_encodeString(const char *string, int version, QRecLevel level, QRencodeMode hint, int casesensitive);
 
+/**
+ * Same to QRcode_encodeString(), but the string is split into the segments
+ * that take the fewest bits, which may give a smaller symbol.
+ * @warning This function is THREAD UNSAFE when pthread is disabled.
+ */
+extern QRcode *QRcode_encodeStringOptimal(const char *string, int version, QRecLevel level, QRencodeMode hint, int casesensitive);
+
 /**
  * Same to QRcode_encodeString(), but encode whole data in 8-bit mode.
  * @warning This function is THREAD UNSAFE when pthread is disabled.
@@ -498,6 +515,13 @@ extern QRcode_List *QRcode_encodeInputStructured(QRinput_Struct *s);
  */
 extern QRcode_List *QRcode_encodeStringStructured(const char *string, int version, QRecLevel level, QRencodeMode hint, int casesensitive);
 
+/**
+ * Same to QRcode_encodeStringStructured(), but the string is split into the
+ * segments that take the fewest bits.
+ * @warning This function is THREAD UNSAFE when pthread is disabled.
+ */
+extern QRcode_List *QRcode_encodeStringStructuredOptimal(const char *string, int version, QRecLevel level, QRencodeMode hint, int casesensitive);
+
 /**
  * Same to QRcode_encodeStringStructured(), but encode whole data in 8-bit mode.
  * @warning This function is THREAD UNSAFE when pthread is disabled.
@@ -533,6 +557,58 @@ extern int QRcode_List_size(QRcode_List *qrlist);
 extern void QRcode_List_free(QRcode_List *qrlist);
 
 
+/******************************************************************************
+ * Measurement
+ *****************************************************************************/
+
+/**
+ * Tell the version and width of the symbol that QRcode_encodeInput() would
+ * make from the input data, and how many of its data bits the data takes,
+ * without encoding it. The lengths are estimated from the segments, so no
+ * error correction code, frame or mask is computed. The input data is not
+ * changed.
+ * @param input input data.
+ * @param measure where the result is stored.
+ * @retval 0 success.
+ * @retval -1 an error occurred and errno is set to indicate the error.
+ * @throw EINVAL FNC1 mode is set, which is not supported.
+ * @throw ERANGE input data is too large.
+ */
+extern int QRcode_measureInput(QRinput *input, QRcode_Measure *measure);
+
+/**
+ * Same to QRcode_measureInput(), for the input data that
+ * QRcode_encodeString() makes of the string.
+ * @throw EINVAL invalid input object.
+ * @throw ENOMEM unable to allocate memory for input objects.
+ * @throw ERANGE input data is too large.
+ */
+extern int QRcode_measureString(const char *string, int version, QRecLevel level, QRencodeMode hint, int casesensitive, QRcode_Measure *measure);
+
+/**
+ * Same to QRcode_measureString(), but for QRcode_encodeStringOptimal().
+ */
+extern int QRcode_measureStringOptimal(const char *string, int version, QRecLevel level, QRencodeMode hint, int casesensitive, QRcode_Measure *measure);
+
+/**
+ * Micro QR Code version of QRcode_measureString().
+ */
+extern int QRcode_measureStringMQR(const char *string, int version, QRecLevel level, QRencodeMode hint, int casesensitive, QRcode_Measure *measure);
+
+/**
+ * Same to QRcode_measureInput(), for the data that QRcode_encodeData()
+ * encodes in 8-bit mode.
+ * @throw EINVAL invalid input object.
+ * @throw ENOMEM unable to allocate memory for input objects.
+ * @throw ERANGE input data is too large.
+ */
+extern int QRcode_measureData(int size, const unsigned char *data, int version, QRecLevel level, QRcode_Measure *measure);
+
+/**
+ * Micro QR Code version of QRcode_measureData().
+ */
+extern int QRcode_measureDataMQR(int size, const unsigned char *data, int version, QRecLevel level, QRcode_Measure *measure);
+
 /******************************************************************************
  * System utilities
  *****************************************************************************/
@@ -553,7 +629,8 @@ extern void QRcode_APIVersion(int *major_version, int *minor_version, int *micro
 extern char *QRcode_APIVersionString(void);
 
 /**
- * @deprecated
+ * Free the tables that the library builds on first use, like the mask
+ * patterns of each version. Must not be called while encoding.
  */
 extern void QRcode_clearCache(void);
 
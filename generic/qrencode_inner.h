@@ -46,6 +46,7 @@ typedef struct {
 	int b1;
 	int blocks;
 	RSblock *rsblock;
+	const int *interleave;
 	int count;
 } QRRawCode;
 
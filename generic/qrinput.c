@@ -29,6 +29,7 @@
 #include "mqrspec.h"
 #include "bitstream.h"
 #include "qrinput.h"
+#include "qrarena.h"
 
 /******************************************************************************
  * Utilities
@@ -51,16 +52,16 @@ static QRinput_List *QRinput_List_newEntry(QRencodeMode mode, int size, const un
 		return NULL;
 	}
 
-	entry = (QRinput_List *)malloc(sizeof(QRinput_List));
+	entry = (QRinput_List *)QRarena_alloc(sizeof(QRinput_List));
 	if(entry == NULL) return NULL;
 
 	entry->mode = mode;
 	entry->size = size;
 	entry->data = NULL;
 	if(size > 0) {
-		entry->data = (unsigned char *)malloc(size);
+		entry->data = (unsigned char *)QRarena_alloc(size);
 		if(entry->data == NULL) {
-			free(entry);
+			QRarena_free(entry);
 			return NULL;
 		}
 		memcpy(entry->data, data, size);
@@ -74,9 +75,9 @@ static QRinput_List *QRinput_List_newEntry(QRencodeMode mode, int size, const un
 static void QRinput_List_freeEntry(QRinput_List *entry)
 {
 	if(entry != NULL) {
-		free(entry->data);
+		QRarena_free(entry->data);
 		BitStream_free(entry->bstream);
-		free(entry);
+		QRarena_free(entry);
 	}
 }
 
@@ -84,14 +85,14 @@ static QRinput_List *QRinput_List_dup(QRinput_List *entry)
 {
 	QRinput_List *n;
 
-	n = (QRinput_List *)malloc(sizeof(QRinput_List));
+	n = (QRinput_List *)QRarena_alloc(sizeof(QRinput_List));
 	if(n == NULL) return NULL;
 
 	n->mode = entry->mode;
 	n->size = entry->size;
-	n->data = (unsigned char *)malloc(n->size);
+	n->data = (unsigned char *)QRarena_alloc(n->size);
 	if(n->data == NULL) {
-		free(n);
+		QRarena_free(n);
 		return NULL;
 	}
 	memcpy(n->data, entry->data, entry->size);
@@ -119,7 +120,7 @@ QRinput *QRinput_new2(int version, QRecLevel level)
 		return NULL;
 	}
 
-	input = (QRinput *)malloc(sizeof(QRinput));
+	input = (QRinput *)QRarena_alloc(sizeof(QRinput));
 	if(input == NULL) return NULL;
 
 	input->head = NULL;
@@ -299,7 +300,7 @@ void QRinput_free(QRinput *input)
 			QRinput_List_freeEntry(list);
 			list = next;
 		}
-		free(input);
+		QRarena_free(input);
 	}
 }
 
@@ -348,6 +349,129 @@ QRinput *QRinput_dup(QRinput *input)
 	return n;
 }
 
+/******************************************************************************
+ * Character classes
+ *****************************************************************************/
+
+/*
+ * The class of every byte is looked up in QRinput_classTable; whole blocks
+ * of 16 (SSE2) or 32 (AVX2) bytes are classified with a few range
+ * comparisons instead. The ranges of the alphanumeric set are ' ', '$'-'%',
+ * '*'-'+', '-'-':' (that takes the digits in) and 'A'-'Z'.
+ */
+const unsigned char QRinput_classTable[256] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	2, 0, 0, 0, 2, 2, 0, 0, 0, 0, 2, 2, 0, 2, 2, 2,
+	3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 2, 0, 0, 0, 0, 0,
+	0, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+	2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 0, 0, 0, 0, 0,
+};
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define QRINPUT_CLASS_BLOCK (32)
+
+static inline __m256i QRinput_inRange(__m256i c, char lo, char hi)
+{
+	__m256i x = _mm256_sub_epi8(c, _mm256_set1_epi8(lo));
+	return _mm256_cmpeq_epi8(_mm256_min_epu8(x, _mm256_set1_epi8((char)(hi - lo))), x);
+}
+
+/* Classes of 32 bytes, returned as the byte masks of digits and of the
+ * alphanumeric set. */
+static inline void QRinput_classifyBlock(const unsigned char *data, __m256i *num, __m256i *an)
+{
+	__m256i c;
+
+	c = _mm256_loadu_si256((const __m256i *)data);
+	*num = QRinput_inRange(c, '0', '9');
+	*an = _mm256_or_si256(
+		_mm256_or_si256(QRinput_inRange(c, '-', ':'), QRinput_inRange(c, 'A', 'Z')),
+		_mm256_or_si256(
+			_mm256_or_si256(QRinput_inRange(c, '$', '%'), QRinput_inRange(c, '*', '+')),
+			_mm256_cmpeq_epi8(c, _mm256_set1_epi8(' '))));
+}
+
+static inline void QRinput_storeClasses(unsigned char *classes, __m256i num, __m256i an)
+{
+	_mm256_storeu_si256((__m256i *)classes, _mm256_or_si256(
+		_mm256_and_si256(an, _mm256_set1_epi8(QRINPUT_CLASS_AN)),
+		_mm256_and_si256(num, _mm256_set1_epi8(QRINPUT_CLASS_NUM))));
+}
+
+#define QRinput_allSet(__mask__) (_mm256_movemask_epi8(__mask__) == -1)
+#define QRinput_vector __m256i
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define QRINPUT_CLASS_BLOCK (16)
+
+static inline __m128i QRinput_inRange(__m128i c, char lo, char hi)
+{
+	__m128i x = _mm_sub_epi8(c, _mm_set1_epi8(lo));
+	return _mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8((char)(hi - lo))), x);
+}
+
+/* Classes of 16 bytes, returned as the byte masks of digits and of the
+ * alphanumeric set. */
+static inline void QRinput_classifyBlock(const unsigned char *data, __m128i *num, __m128i *an)
+{
+	__m128i c;
+
+	c = _mm_loadu_si128((const __m128i *)data);
+	*num = QRinput_inRange(c, '0', '9');
+	*an = _mm_or_si128(
+		_mm_or_si128(QRinput_inRange(c, '-', ':'), QRinput_inRange(c, 'A', 'Z')),
+		_mm_or_si128(
+			_mm_or_si128(QRinput_inRange(c, '$', '%'), QRinput_inRange(c, '*', '+')),
+			_mm_cmpeq_epi8(c, _mm_set1_epi8(' '))));
+}
+
+static inline void QRinput_storeClasses(unsigned char *classes, __m128i num, __m128i an)
+{
+	_mm_storeu_si128((__m128i *)classes, _mm_or_si128(
+		_mm_and_si128(an, _mm_set1_epi8(QRINPUT_CLASS_AN)),
+		_mm_and_si128(num, _mm_set1_epi8(QRINPUT_CLASS_NUM))));
+}
+
+#define QRinput_allSet(__mask__) (_mm_movemask_epi8(__mask__) == 0xffff)
+#define QRinput_vector __m128i
+#endif
+
+void QRinput_classify(int size, const unsigned char *data, unsigned char *classes)
+{
+	int i = 0;
+#ifdef QRINPUT_CLASS_BLOCK
+	QRinput_vector num, an;
+
+	for(; i + QRINPUT_CLASS_BLOCK <= size; i += QRINPUT_CLASS_BLOCK) {
+		QRinput_classifyBlock(&data[i], &num, &an);
+		QRinput_storeClasses(&classes[i], num, an);
+	}
+#endif
+	for(; i < size; i++) {
+		classes[i] = QRinput_classTable[data[i]];
+	}
+}
+
+int QRinput_spanClass(int size, const unsigned char *data, int mask)
+{
+	int i = 0;
+#ifdef QRINPUT_CLASS_BLOCK
+	QRinput_vector num, an;
+
+	for(; i + QRINPUT_CLASS_BLOCK <= size; i += QRINPUT_CLASS_BLOCK) {
+		QRinput_classifyBlock(&data[i], &num, &an);
+		if(!QRinput_allSet((mask & QRINPUT_CLASS_NUM) ? num : an)) break;
+	}
+#endif
+	for(; i < size; i++) {
+		if((QRinput_classTable[data[i]] & mask) != mask) break;
+	}
+
+	return i;
+}
+
 /******************************************************************************
  * Numeric data
  *****************************************************************************/
@@ -360,11 +484,8 @@ QRinput *QRinput_dup(QRinput *input)
  */
 static int QRinput_checkModeNum(int size, const char *data)
 {
-	int i;
-
-	for(i = 0; i < size; i++) {
-		if(data[i] < '0' || data[i] > '9')
-			return -1;
+	if(QRinput_spanClass(size, (const unsigned char *)data, QRINPUT_CLASS_NUM) < size) {
+		return -1;
 	}
 
 	return 0;
@@ -472,11 +593,8 @@ const signed char QRinput_anTable[128] = {
  */
 static int QRinput_checkModeAn(int size, const char *data)
 {
-	int i;
-
-	for(i = 0; i < size; i++) {
-		if(QRinput_lookAnTable(data[i]) < 0)
-			return -1;
+	if(QRinput_spanClass(size, (const unsigned char *)data, QRINPUT_CLASS_AN) < size) {
+		return -1;
 	}
 
 	return 0;
@@ -887,7 +1005,7 @@ static int QRinput_estimateBitStreamSizeOfEntry(QRinput_List *entry, int version
 	}
 
 	if(mqr) {
-		l = QRspec_lengthIndicator(entry->mode, version);
+		l = MQRspec_lengthIndicator(entry->mode, version);
 		m = version - 1;
 		bits += l + m;
 	} else {
@@ -926,7 +1044,7 @@ int QRinput_estimateBitStreamSize(QRinput *input, int version)
  * @param input input data
  * @return required version number
  */
-static int QRinput_estimateVersion(QRinput *input)
+int QRinput_estimateVersion(QRinput *input)
 {
 	int bits;
 	int version, prev;
@@ -1339,7 +1457,7 @@ static QRinput_InputList *QRinput_InputList_newEntry(QRinput *input)
 {
 	QRinput_InputList *entry;
 
-	entry = (QRinput_InputList *)malloc(sizeof(QRinput_InputList));
+	entry = (QRinput_InputList *)QRarena_alloc(sizeof(QRinput_InputList));
 	if(entry == NULL) return NULL;
 
 	entry->input = input;
@@ -1352,7 +1470,7 @@ static void QRinput_InputList_freeEntry(QRinput_InputList *entry)
 {
 	if(entry != NULL) {
 		QRinput_free(entry->input);
-		free(entry);
+		QRarena_free(entry);
 	}
 }
 
@@ -1360,7 +1478,7 @@ QRinput_Struct *QRinput_Struct_new(void)
 {
 	QRinput_Struct *s;
 
-	s = (QRinput_Struct *)malloc(sizeof(QRinput_Struct));
+	s = (QRinput_Struct *)QRarena_alloc(sizeof(QRinput_Struct));
 	if(s == NULL) return NULL;
 
 	s->size = 0;
@@ -1411,7 +1529,7 @@ void QRinput_Struct_free(QRinput_Struct *s)
 			QRinput_InputList_freeEntry(list);
 			list = next;
 		}
-		free(s);
+		QRarena_free(s);
 	}
 }
 
@@ -1435,11 +1553,11 @@ static int QRinput_List_shrinkEntry(QRinput_List *entry, int bytes)
 {
 	unsigned char *data;
 
-	data = (unsigned char *)malloc(bytes);
+	data = (unsigned char *)QRarena_alloc(bytes);
 	if(data == NULL) return -1;
 
 	memcpy(data, entry->data, bytes);
-	free(entry->data);
+	QRarena_free(entry->data);
 	entry->data = data;
 	entry->size = bytes;
 
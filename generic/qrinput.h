@@ -85,8 +85,50 @@ extern int QRinput_estimateBitsModeKanji(int size);
 
 extern QRinput *QRinput_dup(QRinput *input);
 
+/**
+ * Estimate the length of the encoded bit stream of the data.
+ * @param input input data
+ * @param version version of the symbol
+ * @return number of bits
+ */
+extern int QRinput_estimateBitStreamSize(QRinput *input, int version);
+
+/**
+ * Estimate the required version number of the symbol.
+ * @param input input data
+ * @return required version number
+ */
+extern int QRinput_estimateVersion(QRinput *input);
+
 extern const signed char QRinput_anTable[128];
 
+/**
+ * Character classes. QRINPUT_CLASS_AN is set for the 45 characters of the
+ * alphanumeric mode, QRINPUT_CLASS_NUM for the digits among them.
+ */
+#define QRINPUT_CLASS_NUM (1)
+#define QRINPUT_CLASS_AN (2)
+
+extern const unsigned char QRinput_classTable[256];
+
+/**
+ * Classify the data, one class per byte, a vector of bytes at a time where
+ * the CPU allows it.
+ * @param size size of the data
+ * @param data data
+ * @param classes array of size bytes that receives the classes
+ */
+extern void QRinput_classify(int size, const unsigned char *data, unsigned char *classes);
+
+/**
+ * Count the leading bytes that have all bits of mask in their class.
+ * @param size size of the data
+ * @param data data
+ * @param mask QRINPUT_CLASS_NUM or QRINPUT_CLASS_AN
+ * @return length of the span
+ */
+extern int QRinput_spanClass(int size, const unsigned char *data, int mask);
+
 /**
  * Look up the alphabet-numeric convesion table (see JIS X0510:2004, pp.19).
  * @param __c__ character
@@ -114,7 +156,6 @@ extern const signed char QRinput_anTable[128];
 #ifdef WITH_TESTS
 extern int QRinput_mergeBitStream(QRinput *input, BitStream *bstream);
 extern int QRinput_getBitStream(QRinput *input, BitStream *bstream);
-extern int QRinput_estimateBitStreamSize(QRinput *input, int version);
 extern int QRinput_splitEntry(QRinput_List *entry, int bytes);
 extern int QRinput_lengthOfCode(QRencodeMode mode, int version, int bits);
 extern int QRinput_insertStructuredAppendHeader(QRinput *input, int size, int index, unsigned char parity);
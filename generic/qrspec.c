@@ -30,8 +30,12 @@
 #include <string.h>
 #include <errno.h>
 
+#include <tcl.h>
+
 #include "qrspec.h"
+#include "qrarena.h"
 #include "qrinput.h"
+#include "qratomic.h"
 
 /******************************************************************************
  * Version and capacity
@@ -503,9 +507,44 @@ static unsigned char *QRspec_createFrame(int version)
 	return frame;
 }
 
+/**
+ * Cache of initial frames. A frame is built once and published with a
+ * compare-and-swap, so that readers never wait for a lock; a thread that
+ * loses the race frees its own copy. See qratomic.h.
+ */
+static unsigned char *frames[QRSPEC_VERSION_MAX + 1];
+
 unsigned char *QRspec_newFrame(int version)
 {
+	unsigned char *frame, *cached, *prev;
+	int width;
+
 	if(version < 1 || version > QRSPEC_VERSION_MAX) return NULL;
 
-	return QRspec_createFrame(version);
+	cached = QRatomic_loadPtr(&frames[version]);
+	if(cached == NULL) {
+		cached = QRspec_createFrame(version);
+		if(cached == NULL) return NULL;
+		prev = QRatomic_publishPtr(&frames[version], cached);
+		if(prev != NULL) {
+			free(cached);
+			cached = prev;
+		}
+	}
+
+	width = qrspecCapacity[version].width;
+	frame = (unsigned char *)QRarena_alloc(width * width);
+	if(frame == NULL) return NULL;
+	memcpy(frame, cached, width * width);
+
+	return frame;
+}
+
+void QRspec_clearCache(void)
+{
+	int i;
+
+	for(i = 1; i <= QRSPEC_VERSION_MAX; i++) {
+		free(QRatomic_exchangePtr(&frames[i], NULL));
+	}
 }
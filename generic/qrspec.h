@@ -150,10 +150,15 @@ extern unsigned int QRspec_getFormatInfo(int mask, QRecLevel level);
 /**
  * Return a copy of initialized frame.
  * @param version version of the symbol
- * @return Array of unsigned char. You can free it by free().
+ * @return Array of unsigned char. You can free it by QRarena_free().
  */
 extern unsigned char *QRspec_newFrame(int version);
 
+/**
+ * Free the cached frames.
+ */
+extern void QRspec_clearCache(void);
+
 /******************************************************************************
  * Mode indicator
  *****************************************************************************/
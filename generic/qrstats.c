@@ -0,0 +1,192 @@
+/*
+ * qrencode - QR Code encoder
+ *
+ * Stage timers and counters of the encoding pipeline.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#include <tcl.h>
+
+#include "qrstats.h"
+
+long QRstats_enabled = 0;
+
+/*
+ * The stages are timed and the symbols and masks counted per thread, and
+ * merged into stats under one lock when the encode, resp. write is done.
+ */
+typedef struct {
+	QRstatsTimes times;
+	Tcl_WideInt versions[QRSTATS_VERSIONS];
+	Tcl_WideInt mqrVersions[QRSTATS_MQR_VERSIONS];
+	Tcl_WideInt masks[8];
+	Tcl_WideInt mqrMasks[4];
+} QRstatsThread;
+
+static Tcl_ThreadDataKey dataKey;
+
+TCL_DECLARE_MUTEX(QRstats_mutex);
+static QRstats stats;
+
+Tcl_WideInt QRstats_now(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+
+	if(frequency.QuadPart == 0) {
+		QueryPerformanceFrequency(&frequency);
+	}
+	QueryPerformanceCounter(&counter);
+	return (Tcl_WideInt)(counter.QuadPart / frequency.QuadPart) * 1000000000
+		+ (Tcl_WideInt)(counter.QuadPart % frequency.QuadPart) * 1000000000 / frequency.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (Tcl_WideInt)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+	Tcl_Time t;
+
+	Tcl_GetTime(&t);
+	return (Tcl_WideInt)t.sec * 1000000000 + (Tcl_WideInt)t.usec * 1000;
+#endif
+}
+
+static QRstatsThread *QRstats_current(void)
+{
+	return (QRstatsThread *)Tcl_GetThreadData(&dataKey, sizeof(QRstatsThread));
+}
+
+void QRstats_begin(void)
+{
+	if(!QRstats_isEnabled()) return;
+
+	memset(QRstats_current(), 0, sizeof(QRstatsThread));
+}
+
+void QRstats_add(QRstatsStage stage, Tcl_WideInt start)
+{
+	QRstatsTimes *current;
+	Tcl_WideInt elapsed = QRstats_now() - start;
+
+	current = &QRstats_current()->times;
+	current->time[stage] += elapsed;
+	current->calls[stage]++;
+}
+
+/* Merge the stages from first to last, called with QRstats_mutex held. */
+static void QRstats_merge(QRstatsTimes *current, int first, int last)
+{
+	int i;
+
+	for(i = first; i <= last; i++) {
+		stats.total.time[i] += current->time[i];
+		stats.total.calls[i] += current->calls[i];
+		stats.last.time[i] = current->time[i];
+		stats.last.calls[i] = current->calls[i];
+		current->time[i] = 0;
+		current->calls[i] = 0;
+	}
+}
+
+void QRstats_endEncode(int ok)
+{
+	QRstatsThread *current;
+	int i;
+
+	if(!QRstats_isEnabled()) return;
+
+	current = QRstats_current();
+	Tcl_MutexLock(&QRstats_mutex);
+	if(ok) {
+		stats.encodes++;
+		QRstats_merge(&current->times, QRSTATS_SPLIT, QRSTATS_MASK);
+		for(i = 0; i < QRSTATS_VERSIONS; i++) {
+			stats.versions[i] += current->versions[i];
+		}
+		for(i = 0; i < QRSTATS_MQR_VERSIONS; i++) {
+			stats.mqrVersions[i] += current->mqrVersions[i];
+		}
+		for(i = 0; i < 8; i++) {
+			stats.masks[i] += current->masks[i];
+		}
+		for(i = 0; i < 4; i++) {
+			stats.mqrMasks[i] += current->mqrMasks[i];
+		}
+	} else {
+		stats.failures++;
+	}
+	Tcl_MutexUnlock(&QRstats_mutex);
+	memset(current, 0, sizeof(QRstatsThread));
+}
+
+void QRstats_endWrite(void)
+{
+	if(!QRstats_isEnabled()) return;
+
+	Tcl_MutexLock(&QRstats_mutex);
+	QRstats_merge(&QRstats_current()->times, QRSTATS_WRITE, QRSTATS_WRITE);
+	Tcl_MutexUnlock(&QRstats_mutex);
+}
+
+void QRstats_countSymbol(int mqr, int version)
+{
+	QRstatsThread *current;
+
+	if(!QRstats_isEnabled()) return;
+
+	current = QRstats_current();
+	if(mqr) {
+		if(version > 0 && version < QRSTATS_MQR_VERSIONS) current->mqrVersions[version]++;
+	} else {
+		if(version > 0 && version < QRSTATS_VERSIONS) current->versions[version]++;
+	}
+}
+
+void QRstats_countMask(int mqr, int mask)
+{
+	QRstatsThread *current;
+
+	if(!QRstats_isEnabled()) return;
+
+	current = QRstats_current();
+	if(mqr) {
+		if(mask >= 0 && mask < 4) current->mqrMasks[mask]++;
+	} else {
+		if(mask >= 0 && mask < 8) current->masks[mask]++;
+	}
+}
+
+void QRstats_get(QRstats *copy)
+{
+	Tcl_MutexLock(&QRstats_mutex);
+	*copy = stats;
+	Tcl_MutexUnlock(&QRstats_mutex);
+}
+
+void QRstats_reset(void)
+{
+	Tcl_MutexLock(&QRstats_mutex);
+	memset(&stats, 0, sizeof(QRstats));
+	Tcl_MutexUnlock(&QRstats_mutex);
+}
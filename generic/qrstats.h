@@ -0,0 +1,82 @@
+/*
+ * qrencode - QR Code encoder
+ *
+ * Stage timers and counters of the encoding pipeline.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef QRSTATS_H
+#define QRSTATS_H
+
+#include <tcl.h>
+
+#include "qratomic.h"
+
+typedef enum {
+	QRSTATS_SPLIT = 0,	///< Split_splitStringToQRinput()
+	QRSTATS_BITSTREAM,	///< QRinput_getByteStream()
+	QRSTATS_RSECC,		///< RSECC_encode() of all blocks
+	QRSTATS_FILL,		///< module placement
+	QRSTATS_MASK,		///< Mask_mask(), MMask_mask()
+	QRSTATS_WRITE,		///< image writers
+	QRSTATS_STAGES
+} QRstatsStage;
+
+#define QRSTATS_VERSIONS (41)
+#define QRSTATS_MQR_VERSIONS (5)
+
+typedef struct {
+	Tcl_WideInt time[QRSTATS_STAGES];	///< nanoseconds
+	Tcl_WideInt calls[QRSTATS_STAGES];
+} QRstatsTimes;
+
+typedef struct {
+	Tcl_WideInt encodes;
+	Tcl_WideInt failures;
+	QRstatsTimes total;		///< cumulative
+	QRstatsTimes last;		///< of the last encode, resp. write
+	Tcl_WideInt versions[QRSTATS_VERSIONS];
+	Tcl_WideInt mqrVersions[QRSTATS_MQR_VERSIONS];
+	Tcl_WideInt masks[8];
+	Tcl_WideInt mqrMasks[4];
+} QRstats;
+
+/*
+ * Collecting is off until QRstats_enabled is set, until then the
+ * instrumented code only pays for testing it. The flag is shared by all
+ * threads, read it with QRstats_isEnabled() and set it with
+ * QRatomic_storeLong().
+ */
+extern long QRstats_enabled;
+
+#define QRstats_isEnabled() QRatomic_loadLong(&QRstats_enabled)
+
+extern Tcl_WideInt QRstats_now(void);
+extern void QRstats_begin(void);
+extern void QRstats_add(QRstatsStage stage, Tcl_WideInt start);
+extern void QRstats_endEncode(int ok);
+extern void QRstats_endWrite(void);
+extern void QRstats_countSymbol(int mqr, int version);
+extern void QRstats_countMask(int mqr, int mask);
+extern void QRstats_get(QRstats *stats);
+extern void QRstats_reset(void);
+
+#define QRSTATS_START(t) ((t) = QRstats_isEnabled() ? QRstats_now() : 0)
+#define QRSTATS_STOP(stage, t) do { \
+	if((t) != 0) QRstats_add((stage), (t)); \
+} while(0)
+
+#endif /* QRSTATS_H */
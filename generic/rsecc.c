@@ -25,16 +25,25 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 //#ifdef HAVE_LIBPTHREAD
 //#include <pthread.h>
 //#endif
 #include <tcl.h>
 
 #include "rsecc.h"
+#include "qratomic.h"
 
 TCL_DECLARE_MUTEX(RSECC_mutex);
 
-static int initialized = 0;
+/**
+ * All tables are built at once by the first call. Later calls only read
+ * the flag, with acquire semantics, and never take the mutex.
+ */
+static long initialized = 0;
+
+#define RSECC_isInitialized() QRatomic_loadLong(&initialized)
+#define RSECC_setInitialized() QRatomic_storeLong(&initialized, 1)
 
 #define SYMBOL_SIZE (8)
 #define symbols ((1 << SYMBOL_SIZE) - 1)
@@ -48,7 +57,18 @@ static const int proot = 0x11d; /* stands for x^8+x^4+x^3+x^2+1 (see pp.37 of JI
 static unsigned char alpha[symbols + 1];
 static unsigned char aindex[symbols + 1];
 static unsigned char generator[max_length - min_length + 1][max_generatorSize + 1];
-static unsigned char generatorInitialized[max_length - min_length + 1];
+
+/* The ECC register, in 64-bit words. */
+#define register_words (4)
+
+/**
+ * Multiplication tables. mulTable[length][feedback] is the generator of the
+ * given length multiplied by the feedback byte, highest coefficient first,
+ * packed into words like the register: byte j is bits 8*(j%8).. of word j/8.
+ * One step of the LFSR is then a shift of the register by a byte and an XOR
+ * with a table row.
+ */
+static uint64_t mulTable[max_length - min_length + 1][symbols + 1][register_words];
 
 static void RSECC_initLookupTable(void)
 {
@@ -69,13 +89,6 @@ static void RSECC_initLookupTable(void)
 	}
 }
 
-static void RSECC_init(void)
-{
-	RSECC_initLookupTable();
-	memset(generatorInitialized, 0, (max_length - min_length + 1));
-	initialized = 1;
-}
-
 static void generator_init(int length)
 {
 	int i, j;
@@ -95,44 +108,58 @@ static void generator_init(int length)
 		generator[length - min_length][i] = aindex[g[i]];
 	}
 
-	generatorInitialized[length - min_length] = 1;
+	for(i = 1; i <= symbols; i++) {
+		for(j = 0; j < length; j++) {
+			mulTable[length - min_length][i][j / 8] |= (uint64_t)alpha[(aindex[i] + generator[length - min_length][length - 1 - j]) % symbols] << (8 * (j % 8));
+		}
+	}
+
 }
 
-int RSECC_encode(int data_length, int ecc_length, const unsigned char *data, unsigned char *ecc)
+static void RSECC_init(void)
 {
-	int i, j;
-	unsigned char feedback;
-	unsigned char *gen;
-
-Tcl_MutexLock(&RSECC_mutex);
+	int length;
 
+	Tcl_MutexLock(&RSECC_mutex);
 	if(!initialized) {
-		RSECC_init();
+		RSECC_initLookupTable();
+		for(length = min_length; length <= max_length; length++) {
+			generator_init(length);
+		}
+		RSECC_setInitialized();
 	}
+	Tcl_MutexUnlock(&RSECC_mutex);
+}
 
-Tcl_MutexUnlock(&RSECC_mutex);
+int RSECC_encode(int data_length, int ecc_length, const unsigned char *data, unsigned char *ecc)
+{
+	int i;
+	uint64_t r0 = 0, r1 = 0, r2 = 0, r3 = 0;
+	uint64_t reg[register_words];
+	const uint64_t *row;
+	uint64_t (*table)[register_words];
+
+	if(!RSECC_isInitialized()) {
+		RSECC_init();
+	}
 
 	if(ecc_length > max_length) return -1;
 
-	memset(ecc, 0, ecc_length);
-Tcl_MutexLock(&RSECC_mutex);
-	if(!generatorInitialized[ecc_length - min_length]) generator_init(ecc_length);
-Tcl_MutexUnlock(&RSECC_mutex);
-	gen = generator[ecc_length - min_length];
+	table = mulTable[ecc_length - min_length];
 
 	for(i = 0; i < data_length; i++) {
-		feedback = aindex[data[i] ^ ecc[0]];
-		if(feedback != symbols) {
-			for(j = 1; j < ecc_length; j++) {
-				ecc[j] ^= alpha[(feedback + gen[ecc_length - j]) % symbols];
-			}
-		}
-		memmove(&ecc[0], &ecc[1], ecc_length - 1);
-		if(feedback != symbols) {
-			ecc[ecc_length - 1] = alpha[(feedback + gen[0]) % symbols];
-		} else {
-			ecc[ecc_length - 1] = 0;
-		}
+		row = table[(data[i] ^ r0) & 0xff];
+		r0 = ((r0 >> 8) | (r1 << 56)) ^ row[0];
+		r1 = ((r1 >> 8) | (r2 << 56)) ^ row[1];
+		r2 = ((r2 >> 8) | (r3 << 56)) ^ row[2];
+		r3 = (r3 >> 8) ^ row[3];
+	}
+	reg[0] = r0;
+	reg[1] = r1;
+	reg[2] = r2;
+	reg[3] = r3;
+	for(i = 0; i < ecc_length; i++) {
+		ecc[i] = (unsigned char)(reg[i / 8] >> (8 * (i % 8)));
 	}
 
 	return 0;
@@ -28,10 +28,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 #include "qrencode.h"
 #include "qrinput.h"
 #include "qrspec.h"
 #include "split.h"
+#include "qrarena.h"
 
 #define isdigit(__c__) ((unsigned char)((signed char)(__c__) - '0') < 10)
 #define isalnum(__c__) (QRinput_lookAnTable(__c__) >= 0)
@@ -72,32 +74,97 @@ static QRencodeMode Split_identifyMode(const char *string, QRencodeMode hint)
 	return QR_MODE_8;
 }
 
-static int Split_eatAn(const char *string, QRinput *input, QRencodeMode hint);
-static int Split_eat8(const char *string, QRinput *input, QRencodeMode hint);
+/*
+ * The input is classified by QRinput_classify() and a single backward pass
+ * before it is split: mode[i] is what Split_identifyMode() tells at i
+ * (QR_MODE_NUL at the end) and run[i] is the length of the run that starts
+ * at i: of digits at a digit, of alphanumeric characters at the other ones
+ * of that set and of 8-bit characters at those. The splitters below then
+ * look every run up instead of rescanning it.
+ */
+typedef struct {
+	const char *string;
+	int length;
+	signed char *mode;
+	int *run;
+	QRinput *input;
+} Splitter;
+
+static const signed char Split_classMode[4] = {
+	QR_MODE_8, QR_MODE_8, QR_MODE_AN, QR_MODE_NUM
+};
+
+static int Split_initSplitter(Splitter *sp, const char *string, QRinput *input, QRencodeMode hint)
+{
+	int i, c, length, num = 0, an = 0, other = 0;
+	int *run;
+	signed char *mode;
+	unsigned int word;
+
+	length = (int)strlen(string);
+	sp->string = string;
+	sp->length = length;
+	sp->input = input;
+	sp->mode = mode = (signed char *)QRarena_alloc(length + 1);
+	sp->run = run = (int *)QRarena_alloc(sizeof(int) * (length + 1));
+	if(mode == NULL || run == NULL) return -1;
+
+	/* classes first, in place of the modes */
+	QRinput_classify(length, (const unsigned char *)string, (unsigned char *)mode);
+	mode[length] = QR_MODE_NUL;
+	run[length] = 0;
+	for(i = length - 1; i >= 0; i--) {
+		c = (unsigned char)mode[i];
+		if(c != 0) {
+			num = (c & QRINPUT_CLASS_NUM) ? num + 1 : 0;
+			an++;
+			other = 0;
+			run[i] = (c & QRINPUT_CLASS_NUM) ? num : an;
+			mode[i] = Split_classMode[c];
+			continue;
+		}
+		num = an = 0;
+		mode[i] = QR_MODE_8;
+		if(hint == QR_MODE_KANJI && string[i + 1] != '\0') {
+			word = ((unsigned int)(unsigned char)string[i] << 8) | (unsigned char)string[i + 1];
+			if((word >= 0x8140 && word <= 0x9ffc) || (word >= 0xe040 && word <= 0xebbf)) {
+				mode[i] = QR_MODE_KANJI;
+			}
+		}
+		other = (mode[i] == QR_MODE_8) ? other + 1 : 0;
+		run[i] = other;
+	}
+
+	return 0;
+}
 
-static int Split_eatNum(const char *string, QRinput *input,QRencodeMode hint)
+static void Split_freeSplitter(Splitter *sp)
+{
+	QRarena_free(sp->run);
+	QRarena_free(sp->mode);
+}
+
+static int Split_eatAn(Splitter *sp, int pos);
+static int Split_eat8(Splitter *sp, int pos);
+
+static int Split_eatNum(Splitter *sp, int pos)
 {
-	const char *p;
 	int ret;
 	int run;
 	int dif;
 	int ln;
 	QRencodeMode mode;
 
-	ln = QRspec_lengthIndicator(QR_MODE_NUM, input->version);
+	ln = QRspec_lengthIndicator(QR_MODE_NUM, sp->input->version);
 
-	p = string;
-	while(isdigit(*p)) {
-		p++;
-	}
-	run = p - string;
-	mode = Split_identifyMode(p, hint);
+	run = sp->run[pos];
+	mode = (QRencodeMode)sp->mode[pos + run];
 	if(mode == QR_MODE_8) {
 		dif = QRinput_estimateBitsModeNum(run) + 4 + ln
 			+ QRinput_estimateBitsMode8(1) /* + 4 + l8 */
 			- QRinput_estimateBitsMode8(run + 1) /* - 4 - l8 */;
 		if(dif > 0) {
-			return Split_eat8(string, input, hint);
+			return Split_eat8(sp, pos);
 		}
 	}
 	if(mode == QR_MODE_AN) {
@@ -105,38 +172,35 @@ static int Split_eatNum(const char *string, QRinput *input,QRencodeMode hint)
 			+ QRinput_estimateBitsModeAn(1) /* + 4 + la */
 			- QRinput_estimateBitsModeAn(run + 1) /* - 4 - la */;
 		if(dif > 0) {
-			return Split_eatAn(string, input, hint);
+			return Split_eatAn(sp, pos);
 		}
 	}
 
-	ret = QRinput_append(input, QR_MODE_NUM, run, (unsigned char *)string);
+	ret = QRinput_append(sp->input, QR_MODE_NUM, run, (unsigned char *)&sp->string[pos]);
 	if(ret < 0) return -1;
 
 	return run;
 }
 
-static int Split_eatAn(const char *string, QRinput *input, QRencodeMode hint)
+static int Split_eatAn(Splitter *sp, int pos)
 {
-	const char *p, *q;
+	int p, q;
 	int ret;
 	int run;
 	int dif;
 	int la, ln;
 
-	la = QRspec_lengthIndicator(QR_MODE_AN, input->version);
-	ln = QRspec_lengthIndicator(QR_MODE_NUM, input->version);
+	la = QRspec_lengthIndicator(QR_MODE_AN, sp->input->version);
+	ln = QRspec_lengthIndicator(QR_MODE_NUM, sp->input->version);
 
-	p = string;
-	while(isalnum(*p)) {
-		if(isdigit(*p)) {
-			q = p;
-			while(isdigit(*q)) {
-				q++;
-			}
-			dif = QRinput_estimateBitsModeAn(p - string) /* + 4 + la */
+	p = pos;
+	while(sp->mode[p] == QR_MODE_NUM || sp->mode[p] == QR_MODE_AN) {
+		if(sp->mode[p] == QR_MODE_NUM) {
+			q = p + sp->run[p];
+			dif = QRinput_estimateBitsModeAn(p - pos) /* + 4 + la */
 				+ QRinput_estimateBitsModeNum(q - p) + 4 + ln
-				+ (isalnum(*q)?(4 + ln):0)
-				- QRinput_estimateBitsModeAn(q - string) /* - 4 - la */;
+				+ ((sp->mode[q] == QR_MODE_AN) ? (4 + ln) : 0)
+				- QRinput_estimateBitsModeAn(q - pos) /* - 4 - la */;
 			if(dif < 0) {
 				break;
 			}
@@ -146,43 +210,43 @@ static int Split_eatAn(const char *string, QRinput *input, QRencodeMode hint)
 		}
 	}
 
-	run = p - string;
+	run = p - pos;
 
-	if(*p && !isalnum(*p)) {
+	if(sp->mode[p] == QR_MODE_8 || sp->mode[p] == QR_MODE_KANJI) {
 		dif = QRinput_estimateBitsModeAn(run) + 4 + la
 			+ QRinput_estimateBitsMode8(1) /* + 4 + l8 */
 			- QRinput_estimateBitsMode8(run + 1) /* - 4 - l8 */;
 		if(dif > 0) {
-			return Split_eat8(string, input, hint);
+			return Split_eat8(sp, pos);
 		}
 	}
 
-	ret = QRinput_append(input, QR_MODE_AN, run, (unsigned char *)string);
+	ret = QRinput_append(sp->input, QR_MODE_AN, run, (unsigned char *)&sp->string[pos]);
 	if(ret < 0) return -1;
 
 	return run;
 }
 
-static int Split_eatKanji(const char *string, QRinput *input, QRencodeMode hint)
+static int Split_eatKanji(Splitter *sp, int pos)
 {
-	const char *p;
+	int p;
 	int ret;
 	int run;
 
-	p = string;
-	while(Split_identifyMode(p, hint) == QR_MODE_KANJI) {
+	p = pos;
+	while(sp->mode[p] == QR_MODE_KANJI) {
 		p += 2;
 	}
-	run = p - string;
-	ret = QRinput_append(input, QR_MODE_KANJI, run, (unsigned char *)string);
+	run = p - pos;
+	ret = QRinput_append(sp->input, QR_MODE_KANJI, run, (unsigned char *)&sp->string[pos]);
 	if(ret < 0) return -1;
 
 	return run;
 }
 
-static int Split_eat8(const char *string, QRinput *input, QRencodeMode hint)
+static int Split_eat8(Splitter *sp, int pos)
 {
-	const char *p, *q;
+	int p, q;
 	QRencodeMode mode;
 	int ret;
 	int run;
@@ -190,94 +254,235 @@ static int Split_eat8(const char *string, QRinput *input, QRencodeMode hint)
 	int la, ln, l8;
 	int swcost;
 
-	la = QRspec_lengthIndicator(QR_MODE_AN, input->version);
-	ln = QRspec_lengthIndicator(QR_MODE_NUM, input->version);
-	l8 = QRspec_lengthIndicator(QR_MODE_8, input->version);
+	la = QRspec_lengthIndicator(QR_MODE_AN, sp->input->version);
+	ln = QRspec_lengthIndicator(QR_MODE_NUM, sp->input->version);
+	l8 = QRspec_lengthIndicator(QR_MODE_8, sp->input->version);
 
-	p = string + 1;
-	while(*p != '\0') {
-		mode = Split_identifyMode(p, hint);
+	p = pos + 1;
+	while(p < sp->length) {
+		mode = (QRencodeMode)sp->mode[p];
 		if(mode == QR_MODE_KANJI) {
 			break;
 		}
 		if(mode == QR_MODE_NUM) {
-			q = p;
-			while(isdigit(*q)) {
-				q++;
-			}
-			if(Split_identifyMode(q, hint) == QR_MODE_8) {
+			q = p + sp->run[p];
+			if(sp->mode[q] == QR_MODE_8) {
 				swcost = 4 + l8;
 			} else {
 				swcost = 0;
 			}
-			dif = QRinput_estimateBitsMode8(p - string) /* + 4 + l8 */
+			dif = QRinput_estimateBitsMode8(p - pos) /* + 4 + l8 */
 				+ QRinput_estimateBitsModeNum(q - p) + 4 + ln
 				+ swcost
-				- QRinput_estimateBitsMode8(q - string) /* - 4 - l8 */;
+				- QRinput_estimateBitsMode8(q - pos) /* - 4 - l8 */;
 			if(dif < 0) {
 				break;
 			}
 			p = q;
 		} else if(mode == QR_MODE_AN) {
-			q = p;
-			while(isalnum(*q)) {
-				q++;
-			}
-			if(Split_identifyMode(q, hint) == QR_MODE_8) {
+			q = p + sp->run[p];
+			if(sp->mode[q] == QR_MODE_8) {
 				swcost = 4 + l8;
 			} else {
 				swcost = 0;
 			}
-			dif = QRinput_estimateBitsMode8(p - string) /* + 4 + l8 */
+			dif = QRinput_estimateBitsMode8(p - pos) /* + 4 + l8 */
 				+ QRinput_estimateBitsModeAn(q - p) + 4 + la
 				+ swcost
-				- QRinput_estimateBitsMode8(q - string) /* - 4 - l8 */;
+				- QRinput_estimateBitsMode8(q - pos) /* - 4 - l8 */;
 			if(dif < 0) {
 				break;
 			}
 			p = q;
 		} else {
-			p++;
+			p += sp->run[p];
 		}
 	}
 
-	run = p - string;
-	ret = QRinput_append(input, QR_MODE_8, run, (unsigned char *)string);
+	run = p - pos;
+	ret = QRinput_append(sp->input, QR_MODE_8, run, (unsigned char *)&sp->string[pos]);
 	if(ret < 0) return -1;
 
 	return run;
 }
 
-static int Split_splitString(const char *string, QRinput *input,
-		QRencodeMode hint)
+static int Split_splitString(Splitter *sp)
 {
-	int length;
+	int pos, length;
+	QRencodeMode mode;
+
+	for(pos = 0; pos < sp->length; pos += length) {
+		mode = (QRencodeMode)sp->mode[pos];
+		if(mode == QR_MODE_NUM) {
+			length = Split_eatNum(sp, pos);
+		} else if(mode == QR_MODE_AN) {
+			length = Split_eatAn(sp, pos);
+		} else if(mode == QR_MODE_KANJI) {
+			length = Split_eatKanji(sp, pos);
+		} else {
+			length = Split_eat8(sp, pos);
+		}
+		if(length == 0) break;
+		if(length < 0) return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Optimal segmentation
+ *
+ * A shortest path over the input with one state per mode: cost[i * 4 + m]
+ * is the least number of bits that encode the first i bytes with the last
+ * segment in mode m still open. Costs are counted in sixths of a bit so
+ * that every character has an integral cost (numeric 10/3, alphanumeric
+ * 11/2, 8-bit 8, Kanji 13 bits), and a segment is rounded up to whole bits
+ * when it is closed, which gives exactly QRinput_estimateBitsMode*() of its
+ * length. from[] keeps the mode of the previous segment for backtracking,
+ * or'ed with SPLIT_NEW where a segment starts. A segment is never longer
+ * than the length indicator can count, len[] holds the bytes of the open
+ * one; past QRspec_maximumWords() it is closed and a new one is opened,
+ * paying another header, as QRinput_splitEntry() would do.
+ */
+#define SPLIT_MODES (4)
+#define SPLIT_NEW (4)
+#define SPLIT_INF (INT_MAX / 2)
+#define SPLIT_CLOSE(__cost__) (((__cost__) + 5) / 6 * 6)
+
+static const int Split_charCost[SPLIT_MODES] = {20, 33, 48, 78};
+
+static int Split_optimalCost(Splitter *sp, int version, int *cost, int *len,
+		unsigned char *from, QRencodeMode *last)
+{
+	int i, j, m, t, c, best, bestMode;
+	int length = sp->length;
+	int header[SPLIT_MODES], maxWords[SPLIT_MODES];
 	QRencodeMode mode;
 
-	if(*string == '\0') return 0;
+	for(m = 0; m < SPLIT_MODES; m++) {
+		header[m] = (4 + QRspec_lengthIndicator((QRencodeMode)m, version)) * 6;
+		maxWords[m] = QRspec_maximumWords((QRencodeMode)m, version);
+	}
+	for(i = 0; i < (length + 1) * SPLIT_MODES; i++) {
+		cost[i] = SPLIT_INF;
+	}
+
+	for(i = 0; i < length; i++) {
+		/* cheapest way to close the segments that end at i */
+		best = 0;
+		bestMode = 0;
+		if(i > 0) {
+			best = SPLIT_INF;
+			for(m = 0; m < SPLIT_MODES; m++) {
+				c = cost[i * SPLIT_MODES + m];
+				if(c < SPLIT_INF && SPLIT_CLOSE(c) < best) {
+					best = SPLIT_CLOSE(c);
+					bestMode = m;
+				}
+			}
+			if(best == SPLIT_INF) continue;	/* inside a Kanji character */
+		}
+
+		mode = (QRencodeMode)sp->mode[i];
+		for(t = 0; t < SPLIT_MODES; t++) {
+			if(t == QR_MODE_NUM && mode != QR_MODE_NUM) continue;
+			if(t == QR_MODE_AN && mode != QR_MODE_NUM && mode != QR_MODE_AN) continue;
+			if(t == QR_MODE_KANJI && mode != QR_MODE_KANJI) continue;
+			j = i + ((t == QR_MODE_KANJI) ? 2 : 1);
+
+			c = cost[i * SPLIT_MODES + t];
+			if(c < SPLIT_INF && len[i * SPLIT_MODES + t] + j - i <= maxWords[t]
+					&& c + Split_charCost[t] < cost[j * SPLIT_MODES + t]) {
+				cost[j * SPLIT_MODES + t] = c + Split_charCost[t];
+				len[j * SPLIT_MODES + t] = len[i * SPLIT_MODES + t] + j - i;
+				from[j * SPLIT_MODES + t] = (unsigned char)t;
+			}
+			c = best + header[t] + Split_charCost[t];
+			if(c < cost[j * SPLIT_MODES + t]) {
+				cost[j * SPLIT_MODES + t] = c;
+				len[j * SPLIT_MODES + t] = j - i;
+				from[j * SPLIT_MODES + t] = (unsigned char)(bestMode | SPLIT_NEW);
+			}
+		}
+	}
+
+	best = SPLIT_INF;
+	for(m = 0; m < SPLIT_MODES; m++) {
+		c = cost[length * SPLIT_MODES + m];
+		if(c < SPLIT_INF && SPLIT_CLOSE(c) < best) {
+			best = SPLIT_CLOSE(c);
+			*last = (QRencodeMode)m;
+		}
+	}
 
-	mode = Split_identifyMode(string, hint);
-	if(mode == QR_MODE_NUM) {
-		length = Split_eatNum(string, input, hint);
-	} else if(mode == QR_MODE_AN) {
-		length = Split_eatAn(string, input, hint);
-	} else if(mode == QR_MODE_KANJI && hint == QR_MODE_KANJI) {
-		length = Split_eatKanji(string, input, hint);
+	return best / 6;
+}
+
+static int Split_splitStringOptimal(Splitter *sp)
+{
+	int *cost, *len;
+	unsigned char *from, *modes;
+	int length = sp->length;
+	int version, bits, i, j, ret = -1;
+	QRencodeMode mode = QR_MODE_8;
+
+	cost = (int *)QRarena_alloc(sizeof(int) * (length + 1) * SPLIT_MODES);
+	len = (int *)QRarena_alloc(sizeof(int) * (length + 1) * SPLIT_MODES);
+	from = (unsigned char *)QRarena_alloc((length + 1) * SPLIT_MODES);
+	modes = (unsigned char *)QRarena_alloc(length);
+	if(cost == NULL || len == NULL || from == NULL || modes == NULL) goto EXIT;
+
+	/*
+	 * The length indicators only change at versions 10 and 27. Starting
+	 * from the class of the given version, take the narrowest ones whose
+	 * segmentation fits, since the encoder grows the version as needed.
+	 */
+	if(sp->input->version <= 9) {
+		version = 9;
+	} else if(sp->input->version <= 26) {
+		version = 26;
 	} else {
-		length = Split_eat8(string, input, hint);
+		version = QRSPEC_VERSION_MAX;
 	}
-	if(length == 0) return 0;
-	if(length < 0) return -1;
-	return Split_splitString(&string[length], input, hint);
+	for(;;) {
+		bits = Split_optimalCost(sp, version, cost, len, from, &mode);
+		if(version == QRSPEC_VERSION_MAX) break;
+		if(QRspec_getMinimumVersion((bits + 7) / 8, sp->input->level) <= version) break;
+		version = (version == 9) ? 26 : QRSPEC_VERSION_MAX;
+	}
+
+	for(j = length; j > 0; ) {
+		i = j - ((mode == QR_MODE_KANJI) ? 2 : 1);
+		memset(&modes[i], mode, j - i);
+		modes[i] |= from[j * SPLIT_MODES + mode] & SPLIT_NEW;
+		mode = (QRencodeMode)(from[j * SPLIT_MODES + mode] & ~SPLIT_NEW);
+		j = i;
+	}
+
+	for(i = 0; i < length; i = j) {
+		mode = (QRencodeMode)(modes[i] & ~SPLIT_NEW);
+		for(j = i + 1; j < length && modes[j] == mode; j++);
+		if(QRinput_append(sp->input, mode, j - i, (unsigned char *)&sp->string[i]) < 0) goto EXIT;
+	}
+	ret = 0;
+
+EXIT:
+	QRarena_free(modes);
+	QRarena_free(from);
+	QRarena_free(len);
+	QRarena_free(cost);
+	return ret;
 }
 
 static char *dupAndToUpper(const char *str, QRencodeMode hint)
 {
 	char *newstr, *p;
 	QRencodeMode mode;
+	size_t len = strlen(str) + 1;
 
-	newstr = strdup(str);
+	newstr = (char *)QRarena_alloc(len);
 	if(newstr == NULL) return NULL;
+	memcpy(newstr, str, len);
 
 	p = newstr;
 	while(*p != '\0') {
@@ -295,10 +500,11 @@ static char *dupAndToUpper(const char *str, QRencodeMode hint)
 	return newstr;
 }
 
-int Split_splitStringToQRinput(const char *string, QRinput *input,
-		QRencodeMode hint, int casesensitive)
+static int Split_splitStringToQRinputReal(const char *string, QRinput *input,
+		QRencodeMode hint, int casesensitive, int optimal)
 {
-	char *newstr;
+	char *newstr = NULL;
+	Splitter sp;
 	int ret;
 
 	if(string == NULL || *string == '\0') {
@@ -308,11 +514,29 @@ int Split_splitStringToQRinput(const char *string, QRinput *input,
 	if(!casesensitive) {
 		newstr = dupAndToUpper(string, hint);
 		if(newstr == NULL) return -1;
-		ret = Split_splitString(newstr, input, hint);
-		free(newstr);
+		string = newstr;
+	}
+	if(Split_initSplitter(&sp, string, input, hint) < 0) {
+		ret = -1;
+	} else if(optimal && !input->mqr) {
+		ret = Split_splitStringOptimal(&sp);
 	} else {
-		ret = Split_splitString(string, input, hint);
+		ret = Split_splitString(&sp);
 	}
+	Split_freeSplitter(&sp);
+	QRarena_free(newstr);
 
 	return ret;
 }
+
+int Split_splitStringToQRinput(const char *string, QRinput *input,
+		QRencodeMode hint, int casesensitive)
+{
+	return Split_splitStringToQRinputReal(string, input, hint, casesensitive, 0);
+}
+
+int Split_splitStringToQRinputOptimal(const char *string, QRinput *input,
+		QRencodeMode hint, int casesensitive)
+{
+	return Split_splitStringToQRinputReal(string, input, hint, casesensitive, 1);
+}
@@ -44,4 +44,12 @@
 extern int Split_splitStringToQRinput(const char *string, QRinput *input,
 		QRencodeMode hint, int casesensitive);
 
+/**
+ * Same to Split_splitStringToQRinput(), but choose the segmentation that
+ * takes the fewest bits. Micro QR Code input is split as by
+ * Split_splitStringToQRinput().
+ */
+extern int Split_splitStringToQRinputOptimal(const char *string, QRinput *input,
+		QRencodeMode hint, int casesensitive);
+
 #endif /* SPLIT_H */
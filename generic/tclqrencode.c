@@ -33,6 +33,7 @@ Tclqrencode_Init(Tcl_Interp *interp)
     Tcl_CreateObjCommand(interp, "::qrencode::setcasesensitive", SETCASESENSITIVE, (ClientData) NULL, NULL);
     Tcl_CreateObjCommand(interp, "::qrencode::setkanji", SETKANJI, (ClientData) NULL, NULL);
     Tcl_CreateObjCommand(interp, "::qrencode::setmicro", SETMICRO, (ClientData) NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::qrencode::setoptimize", SETOPTIMIZE, (ClientData) NULL, NULL);
     Tcl_CreateObjCommand(interp, "::qrencode::setdpi", SETDPI, (ClientData) NULL, NULL);
     Tcl_CreateObjCommand(interp, "::qrencode::setlevel", SETLEVEL, (ClientData) NULL, NULL);
     Tcl_CreateObjCommand(interp, "::qrencode::setsize", SETSIZE, (ClientData) NULL, NULL);
@@ -43,6 +44,19 @@ Tclqrencode_Init(Tcl_Interp *interp)
     Tcl_CreateObjCommand(interp, "::qrencode::setbackground", SETBACKGROUND, (ClientData) NULL, NULL);
     
     Tcl_CreateObjCommand(interp, "::qrencode::encode", QRENCODE, (ClientData) NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::qrencode::render", QRRENDER, (ClientData) NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::qrencode::write", QRWRITE, (ClientData) NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::qrencode::create", QRCREATE, (ClientData) NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::qrencode::encodebatch", QRENCODEBATCH, (ClientData) NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::qrencode::matrix", QRMATRIX, (ClientData) NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::qrencode::measure", QRMEASURE, (ClientData) NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::qrencode::cache", QRCACHE, (ClientData) NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::qrencode::encodeasync", QRENCODEASYNC, (ClientData) NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::qrencode::stats", QRSTATS, (ClientData) NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::qrencode::setparallelmask", SETPARALLELMASK, (ClientData) NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::qrencode::setarena", SETARENA, (ClientData) NULL, NULL);
+
+    initParallelMask();
 
     return TCL_OK;
 }
@@ -26,25 +26,22 @@
 #include <string.h>
 #include <png.h>
 #include <errno.h>
+#include <stdarg.h>
+#include <stddef.h>
 
 #include "tqrencode.h"
 #include "qrencode.h"
+#include "qrstats.h"
+#include "qrarena.h"
+#include "mask.h"
+#include "qratomic.h"
 
 #define INCHES_PER_METER (100.0/2.54)
 
-static int casesensitive = 1;
-static int eightbit = 0;
-static int version = 0;
-static int size = 3;
-static int margin = 4;
-static int dpi = 72;
-static int structured = 0;
-static int rle = 0;
-static int micro = 0;
-static QRecLevel level = QR_ECLEVEL_L;
-static QRencodeMode hint = QR_MODE_8;
-static unsigned char fg_color[4] = {0, 0, 0, 255};
-static unsigned char bg_color[4] = {255, 255, 255, 255};
+#ifdef _MSC_VER
+#define strcasecmp stricmp
+#define strncasecmp  strnicmp
+#endif
 
 enum imageType {
 	PNG_TYPE,
@@ -62,7 +59,53 @@ enum imageType {
 	ANSIUTF8i_TYPE
 };
 
-static enum imageType image_type = PNG_TYPE;
+/*
+ * Encoder settings. The ::qrencode::set* commands change defaultConfig,
+ * each encoder object made by ::qrencode::create owns a private copy so
+ * that it can encode without taking any lock.
+ */
+typedef struct {
+	int casesensitive;
+	int eightbit;
+	int version;
+	int size;
+	int margin;		/* -1 selects the default for the symbol type */
+	int dpi;
+	int structured;
+	int rle;
+	int micro;
+	int optimize;
+	QRecLevel level;
+	QRencodeMode hint;
+	unsigned char fg_color[4];
+	unsigned char bg_color[4];
+	enum imageType image_type;
+} EncoderConfig;
+
+#define ENCODER_CONFIG_INIT { \
+	1,			/* casesensitive */ \
+	0,			/* eightbit */ \
+	0,			/* version */ \
+	3,			/* size */ \
+	-1,			/* margin */ \
+	72,			/* dpi */ \
+	0,			/* structured */ \
+	0,			/* rle */ \
+	0,			/* micro */ \
+	0,			/* optimize */ \
+	QR_ECLEVEL_L,		/* level */ \
+	QR_MODE_8,		/* hint */ \
+	{0, 0, 0, 255},		/* fg_color */ \
+	{255, 255, 255, 255},	/* bg_color */ \
+	PNG_TYPE		/* image_type */ \
+}
+
+static EncoderConfig defaultConfig = ENCODER_CONFIG_INIT;
+
+/*
+ * Protects defaultConfig only, encoding itself runs unlocked.
+ */
+TCL_DECLARE_MUTEX(qrencodeMutex);
 
 static int color_set(unsigned char color[4], const char *value)
 {
@@ -93,22 +136,251 @@ static int color_set(unsigned char color[4], const char *value)
 }
 
 
-static FILE *openFile(const char *outfile)
+static const char *const imageTypeNames[] = {
+	"png", "png32", "eps", "svg", "xpm", "ansi", "ansi256", "ascii",
+	"asciii", "utf8", "ansiutf8", "utf8i", "ansiutf8i", NULL
+};
+
+static int getImageType(const char *name, enum imageType *type)
 {
+	int i;
+
+	for(i = 0; imageTypeNames[i] != NULL; i++) {
+		if(strcasecmp(name, imageTypeNames[i]) == 0) {
+			*type = (enum imageType)i;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+
+/*
+ * Destination of the image writers: a stdio stream, a Tcl channel, or
+ * else a growable memory buffer. For a channel the memory buffer collects
+ * the small writes of the writers into blocks of OUTPUT_CHANBUFSIZE bytes
+ * that go to the channel driver with Tcl_WriteRaw.
+ */
+typedef struct {
 	FILE *fp;
+	Tcl_Channel chan;
+	int raw;		/* chan is blocking, use Tcl_WriteRaw */
+	unsigned char *data;
+	size_t length;
+	size_t size;
+	int error;
+} Output;
+
+#define OUTPUT_BUFSIZE (4096)
+#define OUTPUT_CHANBUFSIZE (65536)
+
+static int openOutput(Output *out, const char *outfile)
+{
+	memset(out, 0, sizeof(Output));
 
 	if(outfile == NULL || (outfile[0] == '-' && outfile[1] == '\0')) {
-		fp = stdout;
+		out->fp = stdout;
 	} else {
-		fp = fopen(outfile, "wb");
-		if(fp == NULL) {
+		out->fp = fopen(outfile, "wb");
+		if(out->fp == NULL) {
 			fprintf(stderr, "Failed to create file: %s\n", outfile);
 			perror(NULL);
-			return NULL;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+static void openMemoryOutput(Output *out)
+{
+	memset(out, 0, sizeof(Output));
+}
+
+
+/*
+ * Data already buffered in the channel has to go out before ours, which
+ * bypasses that buffer. Tcl_WriteRaw also bypasses stacked transforms
+ * (zlib push, ...), so those as well as non-blocking channels keep using
+ * Tcl_Write, which takes care of partial writes in the background.
+ */
+static int openChannelOutput(Output *out, Tcl_Channel chan)
+{
+	Tcl_DString ds;
+
+	memset(out, 0, sizeof(Output));
+	out->chan = chan;
+
+	Tcl_DStringInit(&ds);
+	if(Tcl_GetChannelOption(NULL, chan, "-blocking", &ds) == TCL_OK) {
+		out->raw = (strcmp(Tcl_DStringValue(&ds), "1") == 0)
+			&& Tcl_GetTopChannel(chan) == chan;
+	}
+	Tcl_DStringFree(&ds);
+
+	if(out->raw && Tcl_Flush(chan) != TCL_OK) {
+		return 1;
+	}
+
+	return 0;
+}
+
+
+static int writeChannel(Output *out, const unsigned char *data, size_t length)
+{
+	Tcl_Size n;
+
+	if(!out->raw) {
+		if(Tcl_Write(out->chan, (const char *)data, (Tcl_Size)length) < 0) {
+			out->error = 1;
+			return -1;
+		}
+		return 0;
+	}
+
+	while(length > 0) {
+		n = Tcl_WriteRaw(out->chan, (const char *)data, (Tcl_Size)length);
+		if(n < 0) {
+			out->error = 1;
+			return -1;
+		}
+		data += n;
+		length -= n;
+	}
+
+	return 0;
+}
+
+
+static int flushChannelOutput(Output *out)
+{
+	int ret = 0;
+
+	if(out->length > 0) {
+		ret = writeChannel(out, out->data, out->length);
+		out->length = 0;
+	}
+
+	return ret;
+}
+
+
+static int closeOutput(Output *out)
+{
+	int error;
+
+	if(out->chan != NULL) {
+		if(!out->error) {
+			flushChannelOutput(out);
+		}
+		free(out->data);
+		out->data = NULL;
+		out->chan = NULL;
+	}
+
+	error = out->error;
+	if(out->fp != NULL) {
+		if(out->fp == stdout) {
+			fflush(stdout);
+		} else if(fclose(out->fp) != 0) {
+			error = 1;
+		}
+		out->fp = NULL;
+	}
+
+	return error;
+}
+
+
+static void freeOutput(Output *out)
+{
+	free(out->data);
+	out->data = NULL;
+	out->length = out->size = 0;
+}
+
+
+static int outputWrite(Output *out, const void *data, size_t length)
+{
+	unsigned char *buffer;
+	size_t size;
+
+	if(out->error) return -1;
+
+	if(out->fp != NULL) {
+		if(fwrite(data, 1, length, out->fp) != length) {
+			out->error = 1;
+			return -1;
+		}
+		return 0;
+	}
+
+	if(out->chan != NULL && out->length + length > OUTPUT_CHANBUFSIZE) {
+		if(flushChannelOutput(out) != 0) {
+			return -1;
+		}
+		if(length >= OUTPUT_CHANBUFSIZE) {
+			return writeChannel(out, (const unsigned char *)data, length);
+		}
+	}
+
+	if(out->length + length > out->size) {
+		size = (out->size > 0) ? out->size : OUTPUT_BUFSIZE;
+		while(size < out->length + length) {
+			size *= 2;
+		}
+		buffer = (unsigned char *)realloc(out->data, size);
+		if(buffer == NULL) {
+			out->error = 1;
+			return -1;
 		}
+		out->data = buffer;
+		out->size = size;
 	}
+	memcpy(out->data + out->length, data, length);
+	out->length += length;
 
-	return fp;
+	return 0;
+}
+
+
+static int outputPuts(Output *out, const char *str)
+{
+	return outputWrite(out, str, strlen(str));
+}
+
+
+static int outputPrintf(Output *out, const char *format, ...)
+{
+	char buffer[256], *p;
+	va_list ap;
+	int len, ret;
+
+	va_start(ap, format);
+	len = vsnprintf(buffer, sizeof(buffer), format, ap);
+	va_end(ap);
+	if(len < 0) {
+		out->error = 1;
+		return -1;
+	}
+	if((size_t)len < sizeof(buffer)) {
+		return outputWrite(out, buffer, len);
+	}
+
+	p = (char *)malloc(len + 1);
+	if(p == NULL) {
+		out->error = 1;
+		return -1;
+	}
+	va_start(ap, format);
+	vsnprintf(p, len + 1, format, ap);
+	va_end(ap);
+	ret = outputWrite(out, p, len);
+	free(p);
+
+	return ret;
 }
 
 
@@ -123,9 +395,28 @@ static void fillRow(unsigned char *row, int size, const unsigned char color[])
 }
 
 
-static int writePNG(const QRcode *qrcode, const char *outfile, enum imageType type)
+static void pngWriteData(png_structp png_ptr, png_bytep data, png_size_t length)
+{
+	Output *out = (Output *)png_get_io_ptr(png_ptr);
+
+	if(outputWrite(out, data, length) < 0) {
+		png_error(png_ptr, "Write error");
+	}
+}
+
+
+static void pngFlushData(png_structp png_ptr)
+{
+	Output *out = (Output *)png_get_io_ptr(png_ptr);
+
+	if(out->fp != NULL) {
+		fflush(out->fp);
+	}
+}
+
+
+static int writePNG(const QRcode *qrcode, const EncoderConfig *cfg, Output *out)
 {
-	static FILE *fp; // avoid clobbering by setjmp.
 	png_structp png_ptr;
 	png_infop info_ptr;
 	png_colorp palette = NULL;
@@ -134,10 +425,10 @@ static int writePNG(const QRcode *qrcode, const char *outfile, enum imageType ty
 	int x, y, xx, yy, bit;
 	int realwidth;
 
-	realwidth = (qrcode->width + margin * 2) * size;
-	if(type == PNG_TYPE) {
+	realwidth = (qrcode->width + cfg->margin * 2) * cfg->size;
+	if(cfg->image_type == PNG_TYPE) {
 		row = (unsigned char *)malloc((realwidth + 7) / 8);
-	} else if(type == PNG32_TYPE) {
+	} else if(cfg->image_type == PNG32_TYPE) {
 		row = (unsigned char *)malloc(realwidth * 4);
 	} else {
 		fprintf(stderr, "Internal error.\n");
@@ -148,13 +439,11 @@ static int writePNG(const QRcode *qrcode, const char *outfile, enum imageType ty
 		return 1;
 	}
 
-	if(outfile[0] == '-' && outfile[1] == '\0') {
-		fp = stdout;
-	} else {
-		fp = fopen(outfile, "wb");
-		if(fp == NULL) {
-			fprintf(stderr, "Failed to create file: %s\n", outfile);
-			perror(NULL);
+	if(cfg->image_type == PNG_TYPE) {
+		palette = (png_colorp) malloc(sizeof(png_color) * 2);
+		if(palette == NULL) {
+			fprintf(stderr, "Failed to allocate memory.\n");
+			free(row);
 			return 1;
 		}
 	}
@@ -162,41 +451,43 @@ static int writePNG(const QRcode *qrcode, const char *outfile, enum imageType ty
 	png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
 	if(png_ptr == NULL) {
 		fprintf(stderr, "Failed to initialize PNG writer.\n");
+		free(row);
+		free(palette);
 		return 1;
 	}
 
 	info_ptr = png_create_info_struct(png_ptr);
 	if(info_ptr == NULL) {
 		fprintf(stderr, "Failed to initialize PNG write.\n");
+		png_destroy_write_struct(&png_ptr, NULL);
+		free(row);
+		free(palette);
 		return 1;
 	}
 
 	if(setjmp(png_jmpbuf(png_ptr))) {
 		png_destroy_write_struct(&png_ptr, &info_ptr);
 		fprintf(stderr, "Failed to write PNG image.\n");
+		free(row);
+		free(palette);
 		return 1;
 	}
 
-	if(type == PNG_TYPE) {
-		palette = (png_colorp) malloc(sizeof(png_color) * 2);
-		if(palette == NULL) {
-			fprintf(stderr, "Failed to allocate memory.\n");
-			return 1;
-		}
-		palette[0].red   = fg_color[0];
-		palette[0].green = fg_color[1];
-		palette[0].blue  = fg_color[2];
-		palette[1].red   = bg_color[0];
-		palette[1].green = bg_color[1];
-		palette[1].blue  = bg_color[2];
-		alpha_values[0] = fg_color[3];
-		alpha_values[1] = bg_color[3];
+	if(cfg->image_type == PNG_TYPE) {
+		palette[0].red   = cfg->fg_color[0];
+		palette[0].green = cfg->fg_color[1];
+		palette[0].blue  = cfg->fg_color[2];
+		palette[1].red   = cfg->bg_color[0];
+		palette[1].green = cfg->bg_color[1];
+		palette[1].blue  = cfg->bg_color[2];
+		alpha_values[0] = cfg->fg_color[3];
+		alpha_values[1] = cfg->bg_color[3];
 		png_set_PLTE(png_ptr, info_ptr, palette, 2);
 		png_set_tRNS(png_ptr, info_ptr, alpha_values, 2, NULL);
 	}
 
-	png_init_io(png_ptr, fp);
-	if(type == PNG_TYPE) {
+	png_set_write_fn(png_ptr, out, pngWriteData, pngFlushData);
+	if(cfg->image_type == PNG_TYPE) {
 		png_set_IHDR(png_ptr, info_ptr,
 				realwidth, realwidth,
 				1,
@@ -214,15 +505,15 @@ static int writePNG(const QRcode *qrcode, const char *outfile, enum imageType ty
 				PNG_FILTER_TYPE_DEFAULT);
 	}
 	png_set_pHYs(png_ptr, info_ptr,
-			dpi * INCHES_PER_METER,
-			dpi * INCHES_PER_METER,
+			cfg->dpi * INCHES_PER_METER,
+			cfg->dpi * INCHES_PER_METER,
 			PNG_RESOLUTION_METER);
 	png_write_info(png_ptr, info_ptr);
 
-	if(type == PNG_TYPE) {
+	if(cfg->image_type == PNG_TYPE) {
 	/* top margin */
 		memset(row, 0xff, (realwidth + 7) / 8);
-		for(y = 0; y < margin * size; y++) {
+		for(y = 0; y < cfg->margin * cfg->size; y++) {
 			png_write_row(png_ptr, row);
 		}
 
@@ -231,10 +522,10 @@ static int writePNG(const QRcode *qrcode, const char *outfile, enum imageType ty
 		for(y = 0; y < qrcode->width; y++) {
 			memset(row, 0xff, (realwidth + 7) / 8);
 			q = row;
-			q += margin * size / 8;
-			bit = 7 - (margin * size % 8);
+			q += cfg->margin * cfg->size / 8;
+			bit = 7 - (cfg->margin * cfg->size % 8);
 			for(x = 0; x < qrcode->width; x++) {
-				for(xx = 0; xx < size; xx++) {
+				for(xx = 0; xx < cfg->size; xx++) {
 					*q ^= (*p & 1) << bit;
 					bit--;
 					if(bit < 0) {
@@ -244,41 +535,41 @@ static int writePNG(const QRcode *qrcode, const char *outfile, enum imageType ty
 				}
 				p++;
 			}
-			for(yy = 0; yy < size; yy++) {
+			for(yy = 0; yy < cfg->size; yy++) {
 				png_write_row(png_ptr, row);
 			}
 		}
 		/* bottom margin */
 		memset(row, 0xff, (realwidth + 7) / 8);
-		for(y = 0; y < margin * size; y++) {
+		for(y = 0; y < cfg->margin * cfg->size; y++) {
 			png_write_row(png_ptr, row);
 		}
 	} else {
 	/* top margin */
-		fillRow(row, realwidth, bg_color);
-		for(y = 0; y < margin * size; y++) {
+		fillRow(row, realwidth, cfg->bg_color);
+		for(y = 0; y < cfg->margin * cfg->size; y++) {
 			png_write_row(png_ptr, row);
 		}
 
 		/* data */
 		p = qrcode->data;
 		for(y = 0; y < qrcode->width; y++) {
-			fillRow(row, realwidth, bg_color);
+			fillRow(row, realwidth, cfg->bg_color);
 			for(x = 0; x < qrcode->width; x++) {
-				for(xx = 0; xx < size; xx++) {
+				for(xx = 0; xx < cfg->size; xx++) {
 					if(*p & 1) {
-						memcpy(&row[((margin + x) * size + xx) * 4], fg_color, 4);
+						memcpy(&row[((cfg->margin + x) * cfg->size + xx) * 4], cfg->fg_color, 4);
 					}
 				}
 				p++;
 			}
-			for(yy = 0; yy < size; yy++) {
+			for(yy = 0; yy < cfg->size; yy++) {
 				png_write_row(png_ptr, row);
 			}
 		}
 		/* bottom margin */
-		fillRow(row, realwidth, bg_color);
-		for(y = 0; y < margin * size; y++) {
+		fillRow(row, realwidth, cfg->bg_color);
+		for(y = 0; y < cfg->margin * cfg->size; y++) {
 			png_write_row(png_ptr, row);
 		}
 	}
@@ -286,7 +577,6 @@ static int writePNG(const QRcode *qrcode, const char *outfile, enum imageType ty
 	png_write_end(png_ptr, info_ptr);
 	png_destroy_write_struct(&png_ptr, &info_ptr);
 
-	fclose(fp);
 	free(row);
 	free(palette);
 
@@ -294,26 +584,20 @@ static int writePNG(const QRcode *qrcode, const char *outfile, enum imageType ty
 }
 
 
-static int writeEPS(const QRcode *qrcode, const char *outfile)
+static int writeEPS(const QRcode *qrcode, const EncoderConfig *cfg, Output *out)
 {
-	FILE *fp;
 	unsigned char *row, *p;
 	int x, y, yy;
 	int realwidth;
 
-	fp = openFile(outfile);
-	if(fp==NULL) {
-		return 1;
-	}
-
-	realwidth = (qrcode->width + margin * 2) * size;
+	realwidth = (qrcode->width + cfg->margin * 2) * cfg->size;
 	/* EPS file header */
-	fprintf(fp, "%%!PS-Adobe-2.0 EPSF-1.2\n"
+	outputPrintf(out, "%%!PS-Adobe-2.0 EPSF-1.2\n"
 				"%%%%BoundingBox: 0 0 %d %d\n"
 				"%%%%Pages: 1 1\n"
 				"%%%%EndComments\n", realwidth, realwidth);
 	/* draw point */
-	fprintf(fp, "/p { "
+	outputPrintf(out, "/p { "
 				"moveto "
 				"0 1 rlineto "
 				"1 0 rlineto "
@@ -321,34 +605,33 @@ static int writeEPS(const QRcode *qrcode, const char *outfile)
 				"fill "
 				"} bind def\n");
 	/* set color */
-	fprintf(fp, "gsave\n");
-	fprintf(fp, "%f %f %f setrgbcolor\n",
-			(float)bg_color[0] / 255,
-			(float)bg_color[1] / 255,
-			(float)bg_color[2] / 255);
-	fprintf(fp, "%d %d scale\n", realwidth, realwidth);
-	fprintf(fp, "0 0 p\ngrestore\n");
-	fprintf(fp, "%f %f %f setrgbcolor\n",
-			(float)fg_color[0] / 255,
-			(float)fg_color[1] / 255,
-			(float)fg_color[2] / 255);
-	fprintf(fp, "%d %d scale\n", size, size);
+	outputPrintf(out, "gsave\n");
+	outputPrintf(out, "%f %f %f setrgbcolor\n",
+			(float)cfg->bg_color[0] / 255,
+			(float)cfg->bg_color[1] / 255,
+			(float)cfg->bg_color[2] / 255);
+	outputPrintf(out, "%d %d scale\n", realwidth, realwidth);
+	outputPrintf(out, "0 0 p\ngrestore\n");
+	outputPrintf(out, "%f %f %f setrgbcolor\n",
+			(float)cfg->fg_color[0] / 255,
+			(float)cfg->fg_color[1] / 255,
+			(float)cfg->fg_color[2] / 255);
+	outputPrintf(out, "%d %d scale\n", cfg->size, cfg->size);
 
 	/* data */
 	p = qrcode->data;
 	for(y = 0; y < qrcode->width; y++) {
 		row = (p+(y*qrcode->width));
-		yy = (margin + qrcode->width - y - 1);
+		yy = (cfg->margin + qrcode->width - y - 1);
 
 		for(x = 0; x < qrcode->width; x++) {
 			if(*(row+x)&0x1) {
-				fprintf(fp, "%d %d p ", margin + x,  yy);
+				outputPrintf(out, "%d %d p ", cfg->margin + x,  yy);
 			}
 		}
 	}
 
-	fprintf(fp, "\n%%%%EOF\n");
-	fclose(fp);
+	outputPrintf(out, "\n%%%%EOF\n");
 
 	return 0;
 }
@@ -381,23 +664,22 @@ int c99_vsnprintf(char* str, size_t size, const char* format, va_list ap)
 #endif
 
 
-static void writeSVG_drawModules(FILE *fp, int x, int y, int width, const char* col, float opacity)
+static void writeSVG_drawModules(const EncoderConfig *cfg, Output *out, int x, int y, int width, const char* col, float opacity)
 {
-    if(fg_color[3] != 255) {
-        fprintf(fp, "\t\t\t<rect x=\"%d\" y=\"%d\" width=\"%d\" height=\"1\" "\
+    if(cfg->fg_color[3] != 255) {
+        outputPrintf(out, "\t\t\t<rect x=\"%d\" y=\"%d\" width=\"%d\" height=\"1\" "\
                 "fill=\"#%s\" fill-opacity=\"%f\"/>\n",
                 x, y, width, col, opacity );
     } else {
-        fprintf(fp, "\t\t\t<rect x=\"%d\" y=\"%d\" width=\"%d\" height=\"1\" "\
+        outputPrintf(out, "\t\t\t<rect x=\"%d\" y=\"%d\" width=\"%d\" height=\"1\" "\
                 "fill=\"#%s\"/>\n",
                 x, y, width, col );
     }
 }
 
 
-static int writeSVG(const QRcode *qrcode, const char *outfile)
+static int writeSVG(const QRcode *qrcode, const EncoderConfig *cfg, Output *out)
 {
-	FILE *fp;
 	unsigned char *row, *p;
 	int x, y, x0, pen;
 	int symwidth, realwidth;
@@ -406,23 +688,18 @@ static int writeSVG(const QRcode *qrcode, const char *outfile)
 	float fg_opacity;
 	float bg_opacity;
 
-	fp = openFile(outfile);
-	if(fp==NULL) {
-		return 1;
-	}
+	scale = cfg->dpi * INCHES_PER_METER / 100.0;
 
-	scale = dpi * INCHES_PER_METER / 100.0;
+	symwidth = qrcode->width + cfg->margin * 2;
+	realwidth = symwidth * cfg->size;
 
-	symwidth = qrcode->width + margin * 2;
-	realwidth = symwidth * size;
-
-	snprintf(fg, 7, "%02x%02x%02x", fg_color[0], fg_color[1],  fg_color[2]);
-	snprintf(bg, 7, "%02x%02x%02x", bg_color[0], bg_color[1],  bg_color[2]);
-	fg_opacity = (float)fg_color[3] / 255;
-	bg_opacity = (float)bg_color[3] / 255;
+	snprintf(fg, 7, "%02x%02x%02x", cfg->fg_color[0], cfg->fg_color[1],  cfg->fg_color[2]);
+	snprintf(bg, 7, "%02x%02x%02x", cfg->bg_color[0], cfg->bg_color[1],  cfg->bg_color[2]);
+	fg_opacity = (float)cfg->fg_color[3] / 255;
+	bg_opacity = (float)cfg->bg_color[3] / 255;
 
 	/* XML declaration */
-	fputs( "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?>\n", fp );
+	outputPuts(out, "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?>\n");
 
 	/* DTD
 	   No document type specified because "while a DTD is provided in [the SVG]
@@ -434,10 +711,10 @@ static int writeSVG(const QRcode *qrcode, const char *outfile)
 	*/
 
 	/* Vanity remark */
-	fprintf(fp, "<!-- Created with qrencode %s (https://fukuchi.org/works/qrencode/index.html) -->\n", QRcode_APIVersionString());
+	outputPrintf(out, "<!-- Created with qrencode %s (https://fukuchi.org/works/qrencode/index.html) -->\n", QRcode_APIVersionString());
 
 	/* SVG code start */
-	fprintf(fp,
+	outputPrintf(out,
 			"<svg width=\"%.2fcm\" height=\"%.2fcm\" viewBox=\"0 0 %d %d\""\
 			" preserveAspectRatio=\"none\" version=\"1.1\""\
 			" xmlns=\"http://www.w3.org/2000/svg\">\n",
@@ -445,28 +722,28 @@ static int writeSVG(const QRcode *qrcode, const char *outfile)
 		   );
 
 	/* Make named group */
-	fputs("\t<g id=\"QRcode\">\n", fp);
+	outputPuts(out, "\t<g id=\"QRcode\">\n");
 
 	/* Make solid background */
-	if(bg_color[3] != 255) {
-		fprintf(fp, "\t\t<rect x=\"0\" y=\"0\" width=\"%d\" height=\"%d\" fill=\"#%s\" fill-opacity=\"%f\"/>\n", symwidth, symwidth, bg, bg_opacity);
+	if(cfg->bg_color[3] != 255) {
+		outputPrintf(out, "\t\t<rect x=\"0\" y=\"0\" width=\"%d\" height=\"%d\" fill=\"#%s\" fill-opacity=\"%f\"/>\n", symwidth, symwidth, bg, bg_opacity);
 	} else {
-		fprintf(fp, "\t\t<rect x=\"0\" y=\"0\" width=\"%d\" height=\"%d\" fill=\"#%s\"/>\n", symwidth, symwidth, bg);
+		outputPrintf(out, "\t\t<rect x=\"0\" y=\"0\" width=\"%d\" height=\"%d\" fill=\"#%s\"/>\n", symwidth, symwidth, bg);
 	}
 
     /* Create new viewbox for QR data */
-    fprintf(fp, "\t\t<g id=\"Pattern\" transform=\"translate(%d,%d)\">\n", margin, margin);
+    outputPrintf(out, "\t\t<g id=\"Pattern\" transform=\"translate(%d,%d)\">\n", cfg->margin, cfg->margin);
 
 	/* Write data */
 	p = qrcode->data;
 	for(y = 0; y < qrcode->width; y++) {
 		row = (p+(y*qrcode->width));
 
-		if( !rle ) {
+		if( !cfg->rle ) {
 			/* no RLE */
 			for(x = 0; x < qrcode->width; x++) {
 				if(*(row+x)&0x1) {
-					writeSVG_drawModules(fp, x, y, 1, fg, fg_opacity);
+					writeSVG_drawModules(cfg, out, x, y, 1, fg, fg_opacity);
 				}
 			}
 		} else {
@@ -478,45 +755,38 @@ static int writeSVG(const QRcode *qrcode, const char *outfile)
 					pen = *(row+x)&0x1;
 					x0 = x;
 				} else if(!(*(row+x)&0x1)) {
-					writeSVG_drawModules(fp, x0, y, x-x0, fg, fg_opacity);
+					writeSVG_drawModules(cfg, out, x0, y, x-x0, fg, fg_opacity);
 					pen = 0;
 				}
 			}
 			if( pen ) {
-				writeSVG_drawModules(fp, x0, y, qrcode->width - x0, fg, fg_opacity);
+				writeSVG_drawModules(cfg, out, x0, y, qrcode->width - x0, fg, fg_opacity);
 			}
 		}
 	}
 
     /* Close QR data viewbox */
-    fputs("\t\t</g>\n", fp);
+    outputPuts(out, "\t\t</g>\n");
 
 	/* Close group */
-	fputs("\t</g>\n", fp);
+	outputPuts(out, "\t</g>\n");
 
 	/* Close SVG code */
-	fputs("</svg>\n", fp);
-	fclose(fp);
+	outputPuts(out, "</svg>\n");
 
 	return 0;
 }
 
 
-static int writeXPM(const QRcode *qrcode, const char *outfile)
+static int writeXPM(const QRcode *qrcode, const EncoderConfig *cfg, Output *out)
 {
-	FILE *fp;
 	int x, xx, y, yy, realwidth, realmargin;
 	char *row;
 	char fg[7], bg[7];
 	unsigned char *p;
 
-	fp = openFile(outfile);
-	if(fp==NULL) {
-		return 1;
-	}
-
-	realwidth = (qrcode->width + margin * 2) * size;
-	realmargin = margin * size;
+	realwidth = (qrcode->width + cfg->margin * 2) * cfg->size;
+	realmargin = cfg->margin * cfg->size;
 
 	row = malloc(realwidth + 1);
 	if (!row ) {
@@ -524,69 +794,68 @@ static int writeXPM(const QRcode *qrcode, const char *outfile)
 		return 1;
 	}
 
-	snprintf(fg, 7, "%02x%02x%02x", fg_color[0], fg_color[1],  fg_color[2]);
-	snprintf(bg, 7, "%02x%02x%02x", bg_color[0], bg_color[1],  bg_color[2]);
+	snprintf(fg, 7, "%02x%02x%02x", cfg->fg_color[0], cfg->fg_color[1],  cfg->fg_color[2]);
+	snprintf(bg, 7, "%02x%02x%02x", cfg->bg_color[0], cfg->bg_color[1],  cfg->bg_color[2]);
 
-	fputs("/* XPM */\n", fp);
-	fputs("static const char *const qrcode_xpm[] = {\n", fp);
-	fputs("/* width height ncolors chars_per_pixel */\n", fp);
-	fprintf(fp, "\"%d %d 2 1\",\n", realwidth, realwidth);
+	outputPuts(out, "/* XPM */\n");
+	outputPuts(out, "static const char *const qrcode_xpm[] = {\n");
+	outputPuts(out, "/* width height ncolors chars_per_pixel */\n");
+	outputPrintf(out, "\"%d %d 2 1\",\n", realwidth, realwidth);
 
-	fputs("/* colors */\n", fp);
-	fprintf(fp, "\"F c #%s\",\n", fg);
-	fprintf(fp, "\"B c #%s\",\n", bg);
+	outputPuts(out, "/* colors */\n");
+	outputPrintf(out, "\"F c #%s\",\n", fg);
+	outputPrintf(out, "\"B c #%s\",\n", bg);
 
-	fputs("/* pixels */\n", fp);
+	outputPuts(out, "/* pixels */\n");
 	memset(row, 'B', realwidth);
 	row[realwidth] = '\0';
 
 	for (y = 0; y < realmargin; y++) {
-		fprintf(fp, "\"%s\",\n", row);
+		outputPrintf(out, "\"%s\",\n", row);
 	}
 
 	p = qrcode->data;
 	for (y = 0; y < qrcode->width; y++) {
-		for (yy = 0; yy < size; yy++) {
-			fputs("\"", fp);
+		for (yy = 0; yy < cfg->size; yy++) {
+			outputPuts(out, "\"");
 
-			for (x = 0; x < margin; x++) {
-				for (xx = 0; xx < size; xx++) {
-					fputs("B", fp);
+			for (x = 0; x < cfg->margin; x++) {
+				for (xx = 0; xx < cfg->size; xx++) {
+					outputPuts(out, "B");
 				}
 			}
 
 			for (x = 0; x < qrcode->width; x++) {
-				for (xx = 0; xx < size; xx++) {
+				for (xx = 0; xx < cfg->size; xx++) {
 					if (p[(y * qrcode->width) + x] & 0x1) {
-						fputs("F", fp);
+						outputPuts(out, "F");
 					} else {
-						fputs("B", fp);
+						outputPuts(out, "B");
 					}
 				}
 			}
 
-			for (x = 0; x < margin; x++) {
-				for (xx = 0; xx < size; xx++) {
-					fputs("B", fp);
+			for (x = 0; x < cfg->margin; x++) {
+				for (xx = 0; xx < cfg->size; xx++) {
+					outputPuts(out, "B");
 				}
 			}
 
-			fputs("\",\n", fp);
+			outputPuts(out, "\",\n");
 		}
 	}
 
 	for (y = 0; y < realmargin; y++) {
-		fprintf(fp, "\"%s\"%s\n", row, y < (size - 1) ? "," : "};");
+		outputPrintf(out, "\"%s\"%s\n", row, y < (cfg->size - 1) ? "," : "};");
 	}
 
 	free(row);
-	fclose(fp);
 
 	return 0;
 }
 
 
-static void writeANSI_margin(FILE* fp, int realwidth,
+static void writeANSI_margin(const EncoderConfig *cfg, Output *out, int realwidth,
                              char* buffer, const char* white, int white_s )
 {
 	int y;
@@ -594,15 +863,14 @@ static void writeANSI_margin(FILE* fp, int realwidth,
 	strncpy(buffer, white, white_s);
 	memset(buffer + white_s, ' ', realwidth * 2);
 	strcpy(buffer + white_s + realwidth * 2, "\033[0m\n"); // reset to default colors
-	for(y = 0; y < margin; y++ ){
-		fputs(buffer, fp);
+	for(y = 0; y < cfg->margin; y++ ){
+		outputPuts(out, buffer);
 	}
 }
 
 
-static int writeANSI(const QRcode *qrcode, const char *outfile)
+static int writeANSI(const QRcode *qrcode, const EncoderConfig *cfg, Output *out)
 {
-	FILE *fp;
 	unsigned char *row, *p;
 	int x, y;
 	int realwidth;
@@ -612,7 +880,7 @@ static int writeANSI(const QRcode *qrcode, const char *outfile)
 	char *buffer;
 	int white_s, black_s, buffer_s;
 
-	if(image_type == ANSI256_TYPE){
+	if(cfg->image_type == ANSI256_TYPE){
 		/* codes for 256 color compatible terminals */
 		white = "\033[48;5;231m";
 		white_s = 11;
@@ -625,14 +893,8 @@ static int writeANSI(const QRcode *qrcode, const char *outfile)
 		black_s = 5;
 	}
 
-	size = 1;
-
-	fp = openFile(outfile);
-	if(fp==NULL) {
-		return 1;
-	}
-
-	realwidth = (qrcode->width + margin * 2) * size;
+	/* one character per module, ignoring the configured pixel size */
+	realwidth = qrcode->width + cfg->margin * 2;
 	buffer_s = (realwidth * white_s) * 2;
 	buffer = (char *)malloc(buffer_s);
 	if(buffer == NULL) {
@@ -641,7 +903,7 @@ static int writeANSI(const QRcode *qrcode, const char *outfile)
 	}
 
 	/* top margin */
-	writeANSI_margin(fp, realwidth, buffer, white, white_s);
+	writeANSI_margin(cfg, out, realwidth, buffer, white, white_s);
 
 	/* data */
 	p = qrcode->data;
@@ -650,7 +912,7 @@ static int writeANSI(const QRcode *qrcode, const char *outfile)
 
 		memset(buffer, 0, buffer_s);
 		strncpy(buffer, white, white_s);
-		for(x = 0; x < margin; x++ ){
+		for(x = 0; x < cfg->margin; x++ ){
 			strncat(buffer, "  ", 2);
 		}
 		last = 0;
@@ -671,41 +933,39 @@ static int writeANSI(const QRcode *qrcode, const char *outfile)
 		if( last != 0 ){
 			strncat(buffer, white, white_s);
 		}
-		for(x = 0; x < margin; x++ ){
+		for(x = 0; x < cfg->margin; x++ ){
 			strncat(buffer, "  ", 2);
 		}
 		strncat(buffer, "\033[0m\n", 5);
-		fputs(buffer, fp);
+		outputPuts(out, buffer);
 	}
 
 	/* bottom margin */
-	writeANSI_margin(fp, realwidth, buffer, white, white_s);
+	writeANSI_margin(cfg, out, realwidth, buffer, white, white_s);
 
-	fclose(fp);
 	free(buffer);
 
 	return 0;
 }
 
 
-static void writeUTF8_margin(FILE* fp, int realwidth, const char* white,
+static void writeUTF8_margin(const EncoderConfig *cfg, Output *out, int realwidth, const char* white,
                              const char *reset, const char* full)
 {
 	int x, y;
 
-	for (y = 0; y < margin/2; y++) {
-		fputs(white, fp);
+	for (y = 0; y < cfg->margin/2; y++) {
+		outputPuts(out, white);
 		for (x = 0; x < realwidth; x++)
-			fputs(full, fp);
-		fputs(reset, fp);
-		fputc('\n', fp);
+			outputPuts(out, full);
+		outputPuts(out, reset);
+		outputPuts(out, "\n");
 	}
 }
 
 
-static int writeUTF8(const QRcode *qrcode, const char *outfile, int use_ansi, int invert)
+static int writeUTF8(const QRcode *qrcode, const EncoderConfig *cfg, Output *out, int use_ansi, int invert)
 {
-	FILE *fp;
 	int x, y;
 	int realwidth;
 	const char *white, *reset;
@@ -736,15 +996,10 @@ static int writeUTF8(const QRcode *qrcode, const char *outfile, int use_ansi, in
 		reset = "";
 	}
 
-	fp = openFile(outfile);
-	if(fp==NULL) {
-		return 1;
-	}
-
-	realwidth = (qrcode->width + margin * 2);
+	realwidth = (qrcode->width + cfg->margin * 2);
 
 	/* top margin */
-	writeUTF8_margin(fp, realwidth, white, reset, full);
+	writeUTF8_margin(cfg, out, realwidth, white, reset, full);
 
 	/* data */
 	for(y = 0; y < qrcode->width; y += 2) {
@@ -752,60 +1007,58 @@ static int writeUTF8(const QRcode *qrcode, const char *outfile, int use_ansi, in
 		row1 = qrcode->data + y*qrcode->width;
 		row2 = row1 + qrcode->width;
 
-		fputs(white, fp);
+		outputPuts(out, white);
 
-		for (x = 0; x < margin; x++) {
-			fputs(full, fp);
+		for (x = 0; x < cfg->margin; x++) {
+			outputPuts(out, full);
 		}
 
 		for (x = 0; x < qrcode->width; x++) {
 			if(row1[x] & 1) {
 				if(y < qrcode->width - 1 && row2[x] & 1) {
-					fputs(empty, fp);
+					outputPuts(out, empty);
 				} else {
-					fputs(lowhalf, fp);
+					outputPuts(out, lowhalf);
 				}
 			} else if(y < qrcode->width - 1 && row2[x] & 1) {
-				fputs(uphalf, fp);
+				outputPuts(out, uphalf);
 			} else {
-				fputs(full, fp);
+				outputPuts(out, full);
 			}
 		}
 
-		for (x = 0; x < margin; x++)
-			fputs(full, fp);
+		for (x = 0; x < cfg->margin; x++)
+			outputPuts(out, full);
 
-		fputs(reset, fp);
-		fputc('\n', fp);
+		outputPuts(out, reset);
+		outputPuts(out, "\n");
 	}
 
 	/* bottom margin */
-	writeUTF8_margin(fp, realwidth, white, reset, full);
+	writeUTF8_margin(cfg, out, realwidth, white, reset, full);
 
-	fclose(fp);
 
 	return 0;
 }
 
 
-static void writeASCII_margin(FILE* fp, int realwidth, char* buffer, int invert)
+static void writeASCII_margin(const EncoderConfig *cfg, Output *out, int realwidth, char* buffer, int invert)
 {
 	int y, h;
 
-	h = margin;
+	h = cfg->margin;
 
 	memset(buffer, (invert?'#':' '), realwidth);
 	buffer[realwidth] = '\n';
 	buffer[realwidth + 1] = '\0';
 	for(y = 0; y < h; y++ ){
-		fputs(buffer, fp);
+		outputPuts(out, buffer);
 	}
 }
 
 
-static int writeASCII(const QRcode *qrcode, const char *outfile, int invert)
+static int writeASCII(const QRcode *qrcode, const EncoderConfig *cfg, Output *out, int invert)
 {
-	FILE *fp;
 	unsigned char *row;
 	int x, y;
 	int realwidth;
@@ -819,14 +1072,7 @@ static int writeASCII(const QRcode *qrcode, const char *outfile, int invert)
 		white = '#';
 	}
 
-	size = 1;
-
-	fp = openFile(outfile);
-	if(fp==NULL) {
-		return 1;
-	}
-
-	realwidth = (qrcode->width + margin * 2) * 2;
+	realwidth = (qrcode->width + cfg->margin * 2) * 2;
 	buffer_s = realwidth + 2;
 	buffer = (char *)malloc( buffer_s );
 	if(buffer == NULL) {
@@ -835,15 +1081,15 @@ static int writeASCII(const QRcode *qrcode, const char *outfile, int invert)
 	}
 
 	/* top margin */
-	writeASCII_margin(fp, realwidth, buffer, invert);
+	writeASCII_margin(cfg, out, realwidth, buffer, invert);
 
 	/* data */
 	for(y = 0; y < qrcode->width; y++) {
 		row = qrcode->data+(y*qrcode->width);
 		p = buffer;
 
-		memset(p, white, margin * 2);
-		p += margin * 2;
+		memset(p, white, cfg->margin * 2);
+		p += cfg->margin * 2;
 
 		for(x = 0; x < qrcode->width; x++) {
 			if(row[x]&0x1) {
@@ -855,136 +1101,981 @@ static int writeASCII(const QRcode *qrcode, const char *outfile, int invert)
 			}
 		}
 
-		memset(p, white, margin * 2);
-		p += margin * 2;
+		memset(p, white, cfg->margin * 2);
+		p += cfg->margin * 2;
 		*p++ = '\n';
 		*p++ = '\0';
-		fputs( buffer, fp );
+		outputPuts(out, buffer);
 	}
 
 	/* bottom margin */
-	writeASCII_margin(fp, realwidth, buffer, invert);
+	writeASCII_margin(cfg, out, realwidth, buffer, invert);
 
-	fclose(fp);
 	free(buffer);
 
 	return 0;
 }
 
 
-static QRcode *encode(const unsigned char *intext, int length)
+/*
+ * Kanji mode expects Shift_JIS, but Tcl strings are UTF-8. sjisTable maps
+ * every character of the BMP that has a Shift_JIS code to it, or to 0 if
+ * it has none. It is built from Tcl's shiftjis encoding by the first
+ * encode in Kanji mode; later ones only read the flag, with acquire
+ * semantics, and never take the mutex.
+ */
+TCL_DECLARE_MUTEX(sjisMutex)
+static long sjisInitialized = 0;
+static unsigned short *sjisTable = NULL;
+
+#define SJIS_isInitialized() QRatomic_loadLong(&sjisInitialized)
+#define SJIS_setInitialized() QRatomic_storeLong(&sjisInitialized, 1)
+
+static void addShiftJIS(Tcl_Encoding encoding, unsigned short *table, int code)
 {
-	QRcode *code;
+	char src[2], dst[16];
+	int srcLen;
+	Tcl_Size srcRead, dstWrote;
+	Tcl_UniChar ch = 0;
+	int c;
+
+	srcLen = (code > 0xff) ? 2 : 1;
+	src[0] = (char)(code >> ((srcLen - 1) * 8));
+	src[1] = (char)code;
+	if(Tcl_ExternalToUtf(NULL, encoding, src, srcLen, TCL_ENCODING_STOPONERROR,
+			NULL, dst, sizeof(dst), &srcRead, &dstWrote, NULL) != TCL_OK) return;
+	if(srcRead != srcLen || Tcl_UtfToUniChar(dst, &ch) != dstWrote) return;
+	/* Keep the first code of characters that have duplicates. */
+	c = ch;
+	if(c >= 0x80 && c <= 0xffff && table[c] == 0) {
+		table[c] = (unsigned short)code;
+	}
+}
 
-	if(micro) {
-		if(eightbit) {
-			code = QRcode_encodeDataMQR(length, intext, version, level);
+static void initShiftJIS(void)
+{
+	Tcl_Encoding encoding;
+	unsigned short *table;
+	int lead, trail;
+
+	Tcl_MutexLock(&sjisMutex);
+	if(!sjisInitialized) {
+		encoding = Tcl_GetEncoding(NULL, "shiftjis");
+		table = (unsigned short *)calloc(0x10000, sizeof(unsigned short));
+		if(encoding != NULL && table != NULL) {
+			/* Half-width katakana, then the double-byte codes. */
+			for(lead = 0xa1; lead <= 0xdf; lead++) {
+				addShiftJIS(encoding, table, lead);
+			}
+			for(lead = 0x81; lead <= 0xfc; lead++) {
+				if(lead == 0xa0) lead = 0xe0;
+				for(trail = 0x40; trail <= 0xfc; trail++) {
+					if(trail == 0x7f) continue;
+					addShiftJIS(encoding, table, (lead << 8) | trail);
+				}
+			}
+			sjisTable = table;
 		} else {
-			code = QRcode_encodeStringMQR((char *)intext, version, level, hint, casesensitive);
+			free(table);
+		}
+		if(encoding != NULL) {
+			Tcl_FreeEncoding(encoding);
+		}
+		SJIS_setInitialized();
+	}
+	Tcl_MutexUnlock(&sjisMutex);
+}
+
+
+/*
+ * Convert the UTF-8 text to Shift_JIS for Kanji mode. Stores a new string
+ * in *sjis and its length in *length, or NULL if some character has no
+ * Shift_JIS code, in which case the text must not be split for Kanji since
+ * its multibyte sequences would be taken for Shift_JIS. Returns -1 if out
+ * of memory.
+ */
+static int toShiftJIS(const unsigned char *intext, int *length, unsigned char **sjis)
+{
+	const unsigned char *p, *end;
+	unsigned char *buffer, *q;
+	Tcl_UniChar ch = 0;
+	int c, code;
+
+	*sjis = NULL;
+	if(!SJIS_isInitialized()) {
+		initShiftJIS();
+	}
+	if(sjisTable == NULL) return 0;
+
+	/* A Shift_JIS code is never longer than the UTF-8 sequence. */
+	buffer = (unsigned char *)malloc(*length + 1);
+	if(buffer == NULL) return -1;
+
+	q = buffer;
+	end = intext + *length;
+	for(p = intext; p < end; ) {
+		if(*p < 0x80) {
+			*q++ = *p++;
+			continue;
 		}
-	} else if(eightbit) {
-		code = QRcode_encodeData(length, intext, version, level);
+		p += Tcl_UtfToUniChar((const char *)p, &ch);
+		/*
+		 * Tcl_UniChar is 16 bits wide in Tcl 8.6, where a character beyond
+		 * the BMP comes out as a surrogate, and 32 bits in Tcl 9. Neither
+		 * surrogates nor those characters have a Shift_JIS code.
+		 */
+		c = ch;
+		code = (c <= 0xffff) ? sjisTable[c] : 0;
+		if(code == 0) {
+			free(buffer);
+			return 0;
+		}
+		if(code > 0xff) {
+			*q++ = (unsigned char)(code >> 8);
+		}
+		*q++ = (unsigned char)code;
+	}
+	*q = '\0';
+
+	*sjis = buffer;
+	*length = (int)(q - buffer);
+
+	return 0;
+}
+
+
+/*
+ * Prepare the text for encoding with cfg. In Kanji mode *intext is replaced
+ * by its Shift_JIS conversion, to be freed by the caller through *sjis, or
+ * *cfg by textCfg in 8-bit mode if there is none. Returns -1 with errno set
+ * on failure.
+ */
+static int convertText(const EncoderConfig **cfg, EncoderConfig *textCfg,
+	const unsigned char **intext, int *length, unsigned char **sjis)
+{
+	*sjis = NULL;
+	if((*cfg)->eightbit || (*cfg)->hint != QR_MODE_KANJI) return 0;
+
+	if(toShiftJIS(*intext, length, sjis) < 0) {
+		errno = ENOMEM;
+		return -1;
+	}
+	if(*sjis != NULL) {
+		*intext = *sjis;
 	} else {
-		code = QRcode_encodeString((char *)intext, version, level, hint, casesensitive);
+		*textCfg = **cfg;
+		textCfg->hint = QR_MODE_8;
+		*cfg = textCfg;
 	}
 
-	return code;
+	return 0;
 }
 
 
-static int qrencode(const unsigned char *intext, int length, const char *outfile)
+static QRcode *encode(const EncoderConfig *cfg, const unsigned char *intext, int length)
 {
-	QRcode *qrcode;
+	QRcode *code;
 
-	qrcode = encode(intext, length);
-	if(qrcode == NULL) {
-		if(errno == ERANGE) {
-			fprintf(stderr, "Failed to encode the input data: Input data too large\n");
+	if(cfg->micro) {
+		if(cfg->eightbit) {
+			code = QRcode_encodeDataMQR(length, intext, cfg->version, cfg->level);
 		} else {
-			perror("Failed to encode the input data");
+			code = QRcode_encodeStringMQR((char *)intext, cfg->version, cfg->level, cfg->hint, cfg->casesensitive);
 		}
-		return 1;
+	} else if(cfg->eightbit) {
+		code = QRcode_encodeData(length, intext, cfg->version, cfg->level);
+	} else {
+		if(cfg->optimize) {
+			code = QRcode_encodeStringOptimal((char *)intext, cfg->version, cfg->level, cfg->hint, cfg->casesensitive);
+		} else {
+			code = QRcode_encodeString((char *)intext, cfg->version, cfg->level, cfg->hint, cfg->casesensitive);
+		}
+	}
+
+	return code;
+}
+
+
+static int measureSymbol(const EncoderConfig *cfg, const unsigned char *intext, int length, QRcode_Measure *measure)
+{
+	if(cfg->micro) {
+		if(cfg->eightbit) {
+			return QRcode_measureDataMQR(length, intext, cfg->version, cfg->level, measure);
+		}
+		return QRcode_measureStringMQR((char *)intext, cfg->version, cfg->level, cfg->hint, cfg->casesensitive, measure);
+	} else if(cfg->eightbit) {
+		return QRcode_measureData(length, intext, cfg->version, cfg->level, measure);
+	} else if(cfg->optimize) {
+		return QRcode_measureStringOptimal((char *)intext, cfg->version, cfg->level, cfg->hint, cfg->casesensitive, measure);
 	}
 
-	switch(image_type) {
+	return QRcode_measureString((char *)intext, cfg->version, cfg->level, cfg->hint, cfg->casesensitive, measure);
+}
+
+
+static int writeImageType(const QRcode *qrcode, const EncoderConfig *cfg, Output *out)
+{
+	switch(cfg->image_type) {
 		case PNG_TYPE:
 		case PNG32_TYPE:
-			writePNG(qrcode, outfile, image_type);
-			break;
+			return writePNG(qrcode, cfg, out);
 		case EPS_TYPE:
-			writeEPS(qrcode, outfile);
-			break;
+			return writeEPS(qrcode, cfg, out);
 		case SVG_TYPE:
-			writeSVG(qrcode, outfile);
-			break;
+			return writeSVG(qrcode, cfg, out);
 		case XPM_TYPE:
-			writeXPM(qrcode, outfile);
-			break;
+			return writeXPM(qrcode, cfg, out);
 		case ANSI_TYPE:
 		case ANSI256_TYPE:
-			writeANSI(qrcode, outfile);
-			break;
+			return writeANSI(qrcode, cfg, out);
 		case ASCIIi_TYPE:
-			writeASCII(qrcode, outfile,  1);
-			break;
+			return writeASCII(qrcode, cfg, out,  1);
 		case ASCII_TYPE:
-			writeASCII(qrcode, outfile,  0);
-			break;
+			return writeASCII(qrcode, cfg, out,  0);
 		case UTF8_TYPE:
-			writeUTF8(qrcode, outfile, 0, 0);
-			break;
+			return writeUTF8(qrcode, cfg, out, 0, 0);
 		case ANSIUTF8_TYPE:
-			writeUTF8(qrcode, outfile, 1, 0);
-			break;
+			return writeUTF8(qrcode, cfg, out, 1, 0);
 		case UTF8i_TYPE:
-			writeUTF8(qrcode, outfile, 0, 1);
-			break;
+			return writeUTF8(qrcode, cfg, out, 0, 1);
 		case ANSIUTF8i_TYPE:
-			writeUTF8(qrcode, outfile, 1, 1);
-			break;
+			return writeUTF8(qrcode, cfg, out, 1, 1);
 		default:
 			fprintf(stderr, "Unknown image type.\n");
 			return 1;
 	}
+}
 
-	QRcode_free(qrcode);
-	return 0;
+
+static int writeImage(const QRcode *qrcode, const EncoderConfig *cfg, Output *out)
+{
+	Tcl_WideInt start;
+	int ret;
+
+	QRstats_begin();
+	QRSTATS_START(start);
+	ret = writeImageType(qrcode, cfg, out);
+	QRSTATS_STOP(QRSTATS_WRITE, start);
+	QRstats_endWrite();
+
+	return ret;
 }
 
 
-static QRcode_List *encodeStructured(const unsigned char *intext, int length)
+static int writeImageFile(const QRcode *qrcode, const EncoderConfig *cfg, const char *outfile)
 {
-	QRcode_List *list;
+	Output out;
+	int ret;
 
-	if(eightbit) {
-		list = QRcode_encodeDataStructured(length, intext, version, level);
-	} else {
-		list = QRcode_encodeStringStructured((char *)intext, version, level, hint, casesensitive);
+	if(openOutput(&out, outfile)) {
+		return 1;
+	}
+	ret = writeImage(qrcode, cfg, &out);
+	if(closeOutput(&out)) {
+		ret = 1;
 	}
 
-	return list;
+	return ret;
 }
 
-#ifdef _MSC_VER
-#define strcasecmp stricmp
-#define strncasecmp  strnicmp
-#endif
+
+static int writeImageChannel(const QRcode *qrcode, const EncoderConfig *cfg, Tcl_Channel chan)
+{
+	Output out;
+	int ret;
+
+	if(openChannelOutput(&out, chan)) {
+		return 1;
+	}
+	ret = writeImage(qrcode, cfg, &out);
+	if(closeOutput(&out)) {
+		ret = 1;
+	}
+
+	return ret;
+}
 
 
-static int qrencodeStructured(const unsigned char *intext, int length, const char *outfile)
+/*
+ * Render the symbol into memory and return the image as a new bytearray
+ * object, or NULL if the writer failed.
+ */
+static Tcl_Obj *writeImageObj(const QRcode *qrcode, const EncoderConfig *cfg)
 {
-	QRcode_List *qrlist, *p;
-	char filename[FILENAME_MAX];
-	char *base, *q, *suffix = NULL;
-	const char *type_suffix;
-	int i = 1;
-	size_t suffix_size;
+	Output out;
+	Tcl_Obj *result = NULL;
 
-	switch(image_type) {
-		case PNG_TYPE:
-		case PNG32_TYPE:
-			type_suffix = ".png";
-			break;
+	openMemoryOutput(&out);
+	if(writeImage(qrcode, cfg, &out) == 0 && !out.error) {
+		result = Tcl_NewByteArrayObj(out.data, (Tcl_Size)out.length);
+	}
+	freeOutput(&out);
+
+	return result;
+}
+
+
+static void setEncodeError(Tcl_Interp *interp)
+{
+	if(errno == ERANGE) {
+		Tcl_SetResult(interp, "Failed to encode the input data: Input data too large", TCL_STATIC);
+	} else {
+		Tcl_SetObjResult(interp, Tcl_ObjPrintf("Failed to encode the input data: %s",
+			Tcl_ErrnoMsg(errno)));
+	}
+}
+
+
+static QRcode_List *encodeStructured(const EncoderConfig *cfg, const unsigned char *intext, int length)
+{
+	QRcode_List *list;
+
+	if(cfg->eightbit) {
+		list = QRcode_encodeDataStructured(length, intext, cfg->version, cfg->level);
+	} else if(cfg->optimize) {
+		list = QRcode_encodeStringStructuredOptimal((char *)intext, cfg->version, cfg->level, cfg->hint, cfg->casesensitive);
+	} else {
+		list = QRcode_encodeStringStructured((char *)intext, cfg->version, cfg->level, cfg->hint, cfg->casesensitive);
+	}
+
+	return list;
+}
+
+
+/*
+ * The settings that the encoded symbols depend on, the others only affect
+ * the writers. Kept free of padding garbage so that it compares by memcmp.
+ */
+typedef struct {
+	int version;
+	QRecLevel level;
+	QRencodeMode hint;
+	int casesensitive;
+	int eightbit;
+	int micro;
+	int structured;
+	int optimize;
+} EncodeParams;
+
+/*
+ * The encoded symbols of one input: count is 1 unless structured symbols
+ * are enabled. Symbols are immutable once encoded and reference counted by
+ * their owners, i.e. the Tcl_Objs they are cached on (see symbolsObjType),
+ * the symbol cache and the encoders that are using them. These may live in
+ * different threads, so refCount is only changed atomically.
+ */
+typedef struct {
+	long refCount;
+	EncodeParams params;
+	int count;
+	QRcode **codes;
+	QRcode_List *list;	/* owns codes when structured */
+} Symbols;
+
+static void getEncodeParams(const EncoderConfig *cfg, EncodeParams *params)
+{
+	memset(params, 0, sizeof(EncodeParams));
+	params->version = cfg->version;
+	params->level = cfg->level;
+	params->hint = cfg->hint;
+	params->casesensitive = cfg->casesensitive;
+	params->eightbit = cfg->eightbit;
+	params->micro = cfg->micro;
+	params->structured = cfg->structured;
+	params->optimize = cfg->optimize;
+}
+
+
+static void freeSymbols(Symbols *symbols)
+{
+	int error = errno;
+
+	if(symbols->list != NULL) {
+		QRcode_List_free(symbols->list);
+	} else if(symbols->codes != NULL && symbols->codes[0] != NULL) {
+		QRcode_free(symbols->codes[0]);
+	}
+	free(symbols->codes);
+	free(symbols);
+
+	errno = error;
+}
+
+
+static void preserveSymbols(Symbols *symbols)
+{
+	QRatomic_incrementLong(&symbols->refCount);
+}
+
+
+static void releaseSymbols(Symbols *symbols)
+{
+	if(QRatomic_decrementLong(&symbols->refCount) <= 0) {
+		freeSymbols(symbols);
+	}
+}
+
+
+/*
+ * Encode the input into new symbols with a zero reference count. Returns
+ * NULL with errno set on failure. Uses no Tcl_Objs or interpreter, so it
+ * can run in any thread.
+ */
+static Symbols *encodeSymbols(const EncoderConfig *cfg, const unsigned char *intext, int length)
+{
+	Symbols *symbols;
+	QRcode_List *p;
+	EncoderConfig textCfg;
+	unsigned char *sjis = NULL;
+	int i;
+
+	QRstats_begin();
+
+	symbols = (Symbols *)calloc(1, sizeof(Symbols));
+	if(symbols == NULL) {
+		QRstats_endEncode(0);
+		errno = ENOMEM;
+		return NULL;
+	}
+	getEncodeParams(cfg, &symbols->params);
+
+	if(convertText(&cfg, &textCfg, &intext, &length, &sjis) < 0) goto ABORT;
+
+	if(cfg->structured) {
+		symbols->list = encodeStructured(cfg, intext, length);
+		if(symbols->list == NULL) goto ABORT;
+		symbols->count = QRcode_List_size(symbols->list);
+		symbols->codes = (QRcode **)malloc(sizeof(QRcode *) * symbols->count);
+		if(symbols->codes == NULL) {
+			errno = ENOMEM;
+			goto ABORT;
+		}
+		for(i = 0, p = symbols->list; p != NULL; i++, p = p->next) {
+			if(p->code == NULL) {
+				errno = EINVAL;
+				goto ABORT;
+			}
+			symbols->codes[i] = p->code;
+		}
+	} else {
+		symbols->codes = (QRcode **)malloc(sizeof(QRcode *));
+		if(symbols->codes == NULL) {
+			errno = ENOMEM;
+			goto ABORT;
+		}
+		symbols->codes[0] = encode(cfg, intext, length);
+		if(symbols->codes[0] == NULL) goto ABORT;
+		symbols->count = 1;
+	}
+
+	for(i = 0; i < symbols->count; i++) {
+		QRstats_countSymbol(cfg->micro, symbols->codes[i]->version);
+	}
+	QRstats_endEncode(1);
+	free(sjis);
+
+	return symbols;
+
+ABORT:
+	i = errno;
+	QRstats_endEncode(0);
+	freeSymbols(symbols);
+	free(sjis);
+	errno = i;
+	return NULL;
+}
+
+
+/*
+ * Tcl_ObjType that caches the encoded symbols on the input string, like Tcl
+ * caches bytecode on a script, so that rendering the same value again (in
+ * another format, say) skips straight to the writer. The string rep is
+ * never invalidated, hence no updateStringProc.
+ */
+static void FreeSymbolsInternalRep(Tcl_Obj *objPtr);
+static void DupSymbolsInternalRep(Tcl_Obj *srcPtr, Tcl_Obj *dupPtr);
+
+static const Tcl_ObjType symbolsObjType = {
+	"qrcode",
+	FreeSymbolsInternalRep,
+	DupSymbolsInternalRep,
+	NULL,
+	NULL
+};
+
+static void FreeSymbolsInternalRep(Tcl_Obj *objPtr)
+{
+	releaseSymbols((Symbols *) objPtr->internalRep.twoPtrValue.ptr1);
+	objPtr->typePtr = NULL;
+}
+
+static void DupSymbolsInternalRep(Tcl_Obj *srcPtr, Tcl_Obj *dupPtr)
+{
+	Symbols *symbols = (Symbols *) srcPtr->internalRep.twoPtrValue.ptr1;
+
+	preserveSymbols(symbols);
+	dupPtr->internalRep.twoPtrValue.ptr1 = symbols;
+	dupPtr->internalRep.twoPtrValue.ptr2 = NULL;
+	dupPtr->typePtr = &symbolsObjType;
+}
+
+/*
+ * Only plain strings, or values that already cache symbols, get the intrep.
+ * Any other type (bytearray, list, dict, int, ...) is left alone: taking
+ * its intrep away would shimmer the value, and a bytearray would then be
+ * encoded from its UTF-8 string rep instead of its bytes.
+ */
+static void setSymbolsInternalRep(Tcl_Obj *objPtr, Symbols *symbols)
+{
+	if(objPtr->typePtr != NULL && objPtr->typePtr != &symbolsObjType) {
+		return;
+	}
+
+	preserveSymbols(symbols);
+	if(objPtr->typePtr != NULL) {
+		objPtr->typePtr->freeIntRepProc(objPtr);
+	}
+	objPtr->internalRep.twoPtrValue.ptr1 = symbols;
+	objPtr->internalRep.twoPtrValue.ptr2 = NULL;
+	objPtr->typePtr = &symbolsObjType;
+}
+
+/*
+ * Return the symbols cached on objPtr if they were encoded with the same
+ * parameters, or NULL.
+ */
+static Symbols *getCachedSymbols(Tcl_Obj *objPtr, const EncoderConfig *cfg)
+{
+	EncodeParams params;
+	Symbols *symbols;
+
+	if(objPtr->typePtr != &symbolsObjType) {
+		return NULL;
+	}
+
+	symbols = (Symbols *) objPtr->internalRep.twoPtrValue.ptr1;
+	getEncodeParams(cfg, &params);
+	if(memcmp(&symbols->params, &params, sizeof(EncodeParams)) != 0) {
+		return NULL;
+	}
+
+	return symbols;
+}
+
+/*
+ * Symbol cache
+ *
+ * A process wide LRU cache of encoded symbols in front of the encoder,
+ * keyed by the payload and the encode parameters and bounded by the memory
+ * used. It catches repeated payloads that do not arrive in the same
+ * Tcl_Obj, e.g. read from a socket, and is shared by all threads. It is
+ * off until -maxbytes is configured.
+ *
+ * The entries are spread over SYMBOL_CACHE_SHARDS shards by the hash of
+ * their key, each with its own mutex, table and LRU list, so encoders only
+ * contend when their payloads fall into the same shard. The bound and the
+ * bytes used are global and changed atomically; when an insert exceeds the
+ * bound the least recently used entries of the shards are evicted, those
+ * of the other shards first. A disabled cache takes no lock at all.
+ */
+
+#ifndef TCL_HASH_TYPE
+#define TCL_HASH_TYPE unsigned
+#endif
+
+#define SYMBOL_CACHE_SHARDS 16
+
+/* The key given to Tcl_FindHashEntry/Tcl_CreateHashEntry. */
+typedef struct {
+	EncodeParams params;
+	int length;
+	const unsigned char *data;
+} CacheKey;
+
+/* The key as stored in the hash entry, the payload follows it. */
+typedef struct {
+	EncodeParams params;
+	int length;
+} StoredKey;
+
+typedef struct CacheEntry {
+	Tcl_HashEntry *hPtr;
+	Symbols *symbols;
+	size_t bytes;
+	struct CacheEntry *prev;	/* towards the most recently used */
+	struct CacheEntry *next;	/* towards the least recently used */
+} CacheEntry;
+
+typedef struct {
+	Tcl_Mutex mutex;
+	int initialized;
+	Tcl_HashTable table;
+	CacheEntry *head;	/* most recently used */
+	CacheEntry *tail;	/* least recently used */
+	Tcl_WideInt hits;
+	Tcl_WideInt misses;
+	Tcl_WideInt evictions;
+} CacheShard;
+
+static struct {
+	Tcl_WideInt bytes;
+	Tcl_WideInt maxbytes;
+	CacheShard shards[SYMBOL_CACHE_SHARDS];
+} symbolCache;
+
+static TCL_HASH_TYPE hashCacheKey(Tcl_HashTable *tablePtr, void *keyPtr)
+{
+	const CacheKey *key = (const CacheKey *) keyPtr;
+	const unsigned char *p;
+	unsigned int hash = 2166136261U;
+	int i;
+
+	p = (const unsigned char *) &key->params;
+	for(i = 0; i < (int)sizeof(EncodeParams); i++) {
+		hash = (hash ^ p[i]) * 16777619U;
+	}
+	for(i = 0; i < key->length; i++) {
+		hash = (hash ^ key->data[i]) * 16777619U;
+	}
+
+	return hash;
+}
+
+static int compareCacheKeys(void *keyPtr, Tcl_HashEntry *hPtr)
+{
+	const CacheKey *key = (const CacheKey *) keyPtr;
+	const StoredKey *stored = (const StoredKey *) hPtr->key.string;
+
+	return key->length == stored->length
+		&& memcmp(&key->params, &stored->params, sizeof(EncodeParams)) == 0
+		&& memcmp(key->data, stored + 1, key->length) == 0;
+}
+
+static Tcl_HashEntry *allocCacheEntry(Tcl_HashTable *tablePtr, void *keyPtr)
+{
+	const CacheKey *key = (const CacheKey *) keyPtr;
+	Tcl_HashEntry *hPtr;
+	StoredKey *stored;
+	size_t size;
+
+	size = offsetof(Tcl_HashEntry, key) + sizeof(StoredKey) + key->length;
+	if(size < sizeof(Tcl_HashEntry)) {
+		size = sizeof(Tcl_HashEntry);
+	}
+	hPtr = (Tcl_HashEntry *) ckalloc(size);
+	stored = (StoredKey *) hPtr->key.string;
+	stored->params = key->params;
+	stored->length = key->length;
+	memcpy(stored + 1, key->data, key->length);
+	hPtr->clientData = NULL;
+
+	return hPtr;
+}
+
+static const Tcl_HashKeyType cacheKeyType = {
+	TCL_HASH_KEY_TYPE_VERSION,
+	0,
+	hashCacheKey,
+	compareCacheKeys,
+	allocCacheEntry,
+	NULL
+};
+
+static size_t getSymbolsSize(const Symbols *symbols)
+{
+	size_t bytes;
+	int i;
+
+	bytes = sizeof(Symbols) + symbols->count * sizeof(QRcode *);
+	for(i = 0; i < symbols->count; i++) {
+		bytes += sizeof(QRcode) + (size_t)symbols->codes[i]->width * symbols->codes[i]->width;
+		if(symbols->list != NULL) {
+			bytes += sizeof(QRcode_List);
+		}
+	}
+
+	return bytes;
+}
+
+static void unlinkCacheEntry(CacheShard *shard, CacheEntry *entry)
+{
+	if(entry->prev != NULL) {
+		entry->prev->next = entry->next;
+	} else {
+		shard->head = entry->next;
+	}
+	if(entry->next != NULL) {
+		entry->next->prev = entry->prev;
+	} else {
+		shard->tail = entry->prev;
+	}
+}
+
+static void linkCacheEntry(CacheShard *shard, CacheEntry *entry)
+{
+	entry->prev = NULL;
+	entry->next = shard->head;
+	if(shard->head != NULL) {
+		shard->head->prev = entry;
+	} else {
+		shard->tail = entry;
+	}
+	shard->head = entry;
+}
+
+/*
+ * Drop an entry from its shard. Returns its symbols if the cache held the
+ * last reference, they have to be freed by the caller after unlocking.
+ */
+static Symbols *removeCacheEntry(CacheShard *shard, CacheEntry *entry)
+{
+	Symbols *symbols = entry->symbols;
+
+	unlinkCacheEntry(shard, entry);
+	Tcl_DeleteHashEntry(entry->hPtr);
+	QRatomic_addWide(&symbolCache.bytes, -(Tcl_WideInt) entry->bytes);
+	ckfree((char *) entry);
+
+	return (QRatomic_decrementLong(&symbols->refCount) <= 0) ? symbols : NULL;
+}
+
+/*
+ * Evict least recently used entries until the cache fits in maxbytes,
+ * going through the shards from first on and locking one at a time. The
+ * symbols to free are chained through *freeList since freeing them does
+ * not need a lock.
+ */
+static void trimCache(Tcl_WideInt maxbytes, int first, Symbols ***freeList, int *nfree)
+{
+	CacheShard *shard;
+	Symbols *symbols;
+	int i;
+
+	for(i = 0; i < SYMBOL_CACHE_SHARDS; i++) {
+		if(QRatomic_loadWide(&symbolCache.bytes) <= maxbytes) break;
+		shard = &symbolCache.shards[(first + i) % SYMBOL_CACHE_SHARDS];
+		Tcl_MutexLock(&shard->mutex);
+		while(shard->tail != NULL && QRatomic_loadWide(&symbolCache.bytes) > maxbytes) {
+			symbols = removeCacheEntry(shard, shard->tail);
+			shard->evictions++;
+			if(symbols != NULL) {
+				*freeList = (Symbols **) ckrealloc((char *) *freeList, sizeof(Symbols *) * (*nfree + 1));
+				(*freeList)[(*nfree)++] = symbols;
+			}
+		}
+		Tcl_MutexUnlock(&shard->mutex);
+	}
+}
+
+static void freeSymbolList(Symbols **freeList, int nfree)
+{
+	int i;
+
+	for(i = 0; i < nfree; i++) {
+		freeSymbols(freeList[i]);
+	}
+	if(freeList != NULL) {
+		ckfree((char *) freeList);
+	}
+}
+
+static void initCacheKey(CacheKey *key, const EncoderConfig *cfg, const unsigned char *intext, int length)
+{
+	getEncodeParams(cfg, &key->params);
+	key->length = length;
+	key->data = intext;
+}
+
+/* The shard of a key, from the high bits that Tcl does not use for the bucket. */
+static int getCacheShard(const CacheKey *key)
+{
+	return (int) ((unsigned int) hashCacheKey(NULL, (void *) key) >> 28) % SYMBOL_CACHE_SHARDS;
+}
+
+static Symbols *lookupCache(const CacheKey *key)
+{
+	CacheShard *shard;
+	Tcl_HashEntry *hPtr;
+	CacheEntry *entry;
+	Symbols *symbols = NULL;
+
+	if(QRatomic_loadWide(&symbolCache.maxbytes) == 0) {
+		return NULL;
+	}
+
+	shard = &symbolCache.shards[getCacheShard(key)];
+	Tcl_MutexLock(&shard->mutex);
+	hPtr = shard->initialized ? Tcl_FindHashEntry(&shard->table, (const char *) key) : NULL;
+	if(hPtr != NULL) {
+		entry = (CacheEntry *) Tcl_GetHashValue(hPtr);
+		unlinkCacheEntry(shard, entry);
+		linkCacheEntry(shard, entry);
+		symbols = entry->symbols;
+		preserveSymbols(symbols);
+		shard->hits++;
+	} else {
+		shard->misses++;
+	}
+	Tcl_MutexUnlock(&shard->mutex);
+
+	return symbols;
+}
+
+static void insertCache(const CacheKey *key, Symbols *symbols)
+{
+	CacheShard *shard;
+	Tcl_HashEntry *hPtr;
+	CacheEntry *entry;
+	Symbols **freeList = NULL;
+	Tcl_WideInt maxbytes;
+	size_t bytes;
+	int index, isNew, nfree = 0;
+
+	maxbytes = QRatomic_loadWide(&symbolCache.maxbytes);
+	if(maxbytes == 0) {
+		return;
+	}
+	bytes = sizeof(CacheEntry) + sizeof(Tcl_HashEntry) + sizeof(StoredKey) + key->length
+		+ getSymbolsSize(symbols);
+	if((Tcl_WideInt) bytes > maxbytes) {
+		return;
+	}
+
+	index = getCacheShard(key);
+	shard = &symbolCache.shards[index];
+	Tcl_MutexLock(&shard->mutex);
+	if(!shard->initialized) {
+		Tcl_InitCustomHashTable(&shard->table, TCL_CUSTOM_PTR_KEYS, &cacheKeyType);
+		shard->initialized = 1;
+	}
+	hPtr = Tcl_CreateHashEntry(&shard->table, (const char *) key, &isNew);
+	/* another thread may have encoded the same payload meanwhile */
+	if(isNew) {
+		entry = (CacheEntry *) ckalloc(sizeof(CacheEntry));
+		entry->hPtr = hPtr;
+		entry->symbols = symbols;
+		entry->bytes = bytes;
+		preserveSymbols(symbols);
+		Tcl_SetHashValue(hPtr, entry);
+		linkCacheEntry(shard, entry);
+		QRatomic_addWide(&symbolCache.bytes, (Tcl_WideInt) bytes);
+	}
+	Tcl_MutexUnlock(&shard->mutex);
+
+	if(isNew) {
+		trimCache(maxbytes, index + 1, &freeList, &nfree);
+		freeSymbolList(freeList, nfree);
+	}
+}
+
+/*
+ * Return the symbols for the input, from the cache or newly encoded, with
+ * a reference owned by the caller. Returns NULL with errno set if the
+ * encoding fails. Does not use Tcl_Objs, so it can run in any thread.
+ */
+static Symbols *getSymbols(const EncoderConfig *cfg, const unsigned char *intext, int length)
+{
+	CacheKey key;
+	Symbols *symbols;
+
+	initCacheKey(&key, cfg, intext, length);
+	symbols = lookupCache(&key);
+	if(symbols != NULL) {
+		return symbols;
+	}
+
+	symbols = encodeSymbols(cfg, intext, length);
+	if(symbols == NULL) {
+		return NULL;
+	}
+	symbols->refCount = 1;
+	insertCache(&key, symbols);
+
+	return symbols;
+}
+
+/*
+ * Get the payload of objPtr. In 8-bit mode a bytearray is used as it is,
+ * so binary data keeps its NUL bytes and never gets a string rep; *binary
+ * tells that the symbols must not be cached on such an object since that
+ * would shimmer it. Anything else is encoded from its string rep, whose
+ * length Tcl already knows.
+ */
+static const unsigned char *getPayload(Tcl_Obj *objPtr, const EncoderConfig *cfg, int *length, int *binary)
+{
+	static const Tcl_ObjType *byteArrayType = NULL;
+	const unsigned char *intext;
+	Tcl_Size len;
+
+	if(byteArrayType == NULL) {
+		byteArrayType = Tcl_GetObjType("bytearray");
+	}
+
+	if(cfg->eightbit && objPtr->typePtr != NULL && objPtr->typePtr == byteArrayType) {
+		intext = Tcl_GetByteArrayFromObj(objPtr, &len);
+		*binary = 1;
+	} else {
+		intext = (const unsigned char *) Tcl_GetStringFromObj(objPtr, &len);
+		*binary = 0;
+	}
+	*length = (int) len;
+
+	return intext;
+}
+
+/*
+ * Return the symbols for the payload of objPtr, encoding it if needed. The
+ * caller owns a reference to the result and has to release it.
+ */
+static Symbols *getSymbolsFromObj(Tcl_Interp *interp, Tcl_Obj *objPtr, const EncoderConfig *cfg)
+{
+	Symbols *symbols;
+	const unsigned char *intext;
+	int length, binary;
+
+	symbols = getCachedSymbols(objPtr, cfg);
+	if(symbols != NULL) {
+		preserveSymbols(symbols);
+		return symbols;
+	}
+
+	intext = getPayload(objPtr, cfg, &length, &binary);
+	if(length < 1) {
+		Tcl_SetResult(interp, "empty string", TCL_STATIC);
+		return NULL;
+	}
+	symbols = getSymbols(cfg, intext, length);
+	if(symbols == NULL) {
+		setEncodeError(interp);
+		return NULL;
+	}
+	if(!binary) {
+		setSymbolsInternalRep(objPtr, symbols);
+	}
+
+	return symbols;
+}
+
+
+static int qrencode(const EncoderConfig *cfg, const Symbols *symbols, const char *outfile)
+{
+	return writeImageFile(symbols->codes[0], cfg, outfile);
+}
+
+
+static int qrencodeStructured(const EncoderConfig *cfg, const Symbols *symbols, const char *outfile)
+{
+	char filename[FILENAME_MAX];
+	char *base, *q, *suffix = NULL;
+	const char *type_suffix;
+	int i, ret = 0;
+	size_t suffix_size;
+
+	switch(cfg->image_type) {
+		case PNG_TYPE:
+		case PNG32_TYPE:
+			type_suffix = ".png";
+			break;
 		case EPS_TYPE:
 			type_suffix = ".eps";
 			break;
@@ -1026,69 +2117,17 @@ static int qrencodeStructured(const unsigned char *intext, int length, const cha
 		}
 	}
 
-	qrlist = encodeStructured(intext, length);
-	if(qrlist == NULL) {
-		if(errno == ERANGE) {
-			fprintf(stderr, "Failed to encode the input data: Input data too large\n");
+	for(i = 0; i < symbols->count; i++) {
+		if(suffix) {
+			snprintf(filename, FILENAME_MAX, "%s-%02d%s", base, i + 1, suffix);
 		} else {
-			perror("Failed to encode the input data");
+			snprintf(filename, FILENAME_MAX, "%s-%02d", base, i + 1);
 		}
-		return 1;
-	}
 
-	for(p = qrlist; p != NULL; p = p->next) {
-		if(p->code == NULL) {
-			fprintf(stderr, "Failed to encode the input data.\n");
-			return 1;
+		if(writeImageFile(symbols->codes[i], cfg, filename)) {
+			ret = 1;
+			break;
 		}
-		if(suffix) {
-			snprintf(filename, FILENAME_MAX, "%s-%02d%s", base, i, suffix);
-		} else {
-			snprintf(filename, FILENAME_MAX, "%s-%02d", base, i);
-		}
-
-		switch(image_type) {
-			case PNG_TYPE:
-			case PNG32_TYPE:
-				writePNG(p->code, filename, image_type);
-				break;
-			case EPS_TYPE:
-				writeEPS(p->code, filename);
-				break;
-			case SVG_TYPE:
-				writeSVG(p->code, filename);
-				break;
-			case XPM_TYPE:
-				writeXPM(p->code, filename);
-				break;
-			case ANSI_TYPE:
-			case ANSI256_TYPE:
-				writeANSI(p->code, filename);
-				break;
-			case ASCIIi_TYPE:
-				writeASCII(p->code, filename, 1);
-				break;
-			case ASCII_TYPE:
-				writeASCII(p->code, filename, 0);
-				break;
-			case UTF8_TYPE:
-				writeUTF8(p->code, filename, 0, 0);
-				break;
-			case ANSIUTF8_TYPE:
-				writeUTF8(p->code, filename, 0, 0);
-				break;
-			case UTF8i_TYPE:
-				writeUTF8(p->code, filename, 0, 1);
-				break;
-			case ANSIUTF8i_TYPE:
-				writeUTF8(p->code, filename, 0, 1);
-				break;
-
-			default:
-				fprintf(stderr, "Unknown image type.\n");
-				return 1;
-		}
-		i++;
 	}
 
 	free(base);
@@ -1096,8 +2135,43 @@ static int qrencodeStructured(const unsigned char *intext, int length, const cha
 		free(suffix);
 	}
 
-	QRcode_List_free(qrlist);
-	return 0;
+	return ret;
+}
+
+
+/*
+ * In-memory counterpart of qrencode() and qrencodeStructured(): the image
+ * is left in the interpreter result as a bytearray, or as a list of
+ * bytearrays when structured symbols are enabled.
+ */
+static int qrencodeObj(Tcl_Interp *interp, const EncoderConfig *cfg, const Symbols *symbols)
+{
+	Tcl_Obj *image, *list;
+	int i;
+
+	if(cfg->structured) {
+		list = Tcl_NewListObj(0, NULL);
+		for(i = 0; i < symbols->count; i++) {
+			image = writeImageObj(symbols->codes[i], cfg);
+			if(image == NULL) {
+				Tcl_DecrRefCount(list);
+				Tcl_SetResult(interp, "Failed to write the image", TCL_STATIC);
+				return TCL_ERROR;
+			}
+			Tcl_ListObjAppendElement(NULL, list, image);
+		}
+		Tcl_SetObjResult(interp, list);
+		return TCL_OK;
+	}
+
+	image = writeImageObj(symbols->codes[0], cfg);
+	if(image == NULL) {
+		Tcl_SetResult(interp, "Failed to write the image", TCL_STATIC);
+		return TCL_ERROR;
+	}
+	Tcl_SetObjResult(interp, image);
+
+	return TCL_OK;
 }
 
 
@@ -1115,10 +2189,12 @@ int SETMODE_8BIT (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *
         return TCL_ERROR;
     }
     
+    Tcl_MutexLock(&qrencodeMutex);
     if(m_eightbit > 0)
-      eightbit = 1;
+      defaultConfig.eightbit = 1;
     else
-      eightbit = 0;
+      defaultConfig.eightbit = 0;
+    Tcl_MutexUnlock(&qrencodeMutex);
     
     
     return TCL_OK;    
@@ -1144,7 +2220,9 @@ int SETCASESENSITIVE (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_O
     else
       m_casesensitive = 0;
     
-    casesensitive = m_casesensitive;
+    Tcl_MutexLock(&qrencodeMutex);
+    defaultConfig.casesensitive = m_casesensitive;
+    Tcl_MutexUnlock(&qrencodeMutex);
 
     return TCL_OK;    
 }
@@ -1164,10 +2242,12 @@ int SETKANJI (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *cons
         return TCL_ERROR;
     }
     
+    Tcl_MutexLock(&qrencodeMutex);
     if(m_hint > 0)
-      hint = QR_MODE_KANJI;
+      defaultConfig.hint = QR_MODE_KANJI;
     else
-      hint = QR_MODE_8;
+      defaultConfig.hint = QR_MODE_8;
+    Tcl_MutexUnlock(&qrencodeMutex);
     
     return TCL_OK;    
 }
@@ -1187,37 +2267,61 @@ int SETMICRO (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *cons
         return TCL_ERROR;
     }
     
+    Tcl_MutexLock(&qrencodeMutex);
     if(m_micro > 0)
-      micro = 1;
+      defaultConfig.micro = 1;
     else
-      micro = 0;
-    
-    micro = m_micro;
+      defaultConfig.micro = 0;
+    Tcl_MutexUnlock(&qrencodeMutex);
     
     return TCL_OK;    
 }
 
 
-int SETDPI (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const obj[])
+int SETOPTIMIZE (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const obj[])
 {
-    int m_dpi;
-    
+    int m_optimize;
+
     if(objc != 2)
     {
-        Tcl_WrongNumArgs(interp, 1, obj, "dpi");
+        Tcl_WrongNumArgs(interp, 1, obj, "optimize");
         return TCL_ERROR;
     }
-    
-    if(Tcl_GetIntFromObj(interp, obj[1], &m_dpi) != TCL_OK) {
+
+    if(Tcl_GetBooleanFromObj(interp, obj[1], &m_optimize) != TCL_OK) {
         return TCL_ERROR;
     }
-    
-    if(m_dpi <= 0)
-        dpi = 720;
-    else          
-        dpi = m_dpi;
-    
-    return TCL_OK;    
+
+    Tcl_MutexLock(&qrencodeMutex);
+    defaultConfig.optimize = m_optimize;
+    Tcl_MutexUnlock(&qrencodeMutex);
+
+    return TCL_OK;
+}
+
+
+int SETDPI (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const obj[])
+{
+    int m_dpi;
+    
+    if(objc != 2)
+    {
+        Tcl_WrongNumArgs(interp, 1, obj, "dpi");
+        return TCL_ERROR;
+    }
+    
+    if(Tcl_GetIntFromObj(interp, obj[1], &m_dpi) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    
+    Tcl_MutexLock(&qrencodeMutex);
+    if(m_dpi <= 0)
+        defaultConfig.dpi = 720;
+    else          
+        defaultConfig.dpi = m_dpi;
+    Tcl_MutexUnlock(&qrencodeMutex);
+    
+    return TCL_OK;    
 }
 
 
@@ -1235,10 +2339,12 @@ int SETLEVEL (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *cons
         return TCL_ERROR;
     }
     
+    Tcl_MutexLock(&qrencodeMutex);
     if(m_level >= 0 && m_level <= 3)
-        level = m_level;
+        defaultConfig.level = m_level;
     else
-        level = 0;
+        defaultConfig.level = 0;
+    Tcl_MutexUnlock(&qrencodeMutex);
     
     
     return TCL_OK;    
@@ -1263,7 +2369,9 @@ int SETSIZE (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const
         return TCL_ERROR;
     } 
         
-    size = m_size;
+    Tcl_MutexLock(&qrencodeMutex);
+    defaultConfig.size = m_size;
+    Tcl_MutexUnlock(&qrencodeMutex);
     
     
     return TCL_OK;   
@@ -1285,11 +2393,13 @@ int SETSTRUCTURED (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj
         return TCL_ERROR;
     }
 
+    Tcl_MutexLock(&qrencodeMutex);
     if(m_structured > 0 ) {
-        structured = 1;
+        defaultConfig.structured = 1;
     } else {
-        structured = 0;      
+        defaultConfig.structured = 0;      
     }    
+    Tcl_MutexUnlock(&qrencodeMutex);
     
     return TCL_OK;   
 }
@@ -1311,31 +2421,11 @@ int SETFILETYPE (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *c
         return TCL_ERROR;
     }
         
-    if(strcasecmp(filetype, "png") == 0) {
-        image_type = PNG_TYPE;
-    } else if(strcasecmp(filetype, "png32") == 0) {
-        image_type = PNG32_TYPE;
-    } else if(strcasecmp(filetype, "eps") == 0) {
-        image_type = EPS_TYPE;
-    } else if(strcasecmp(filetype, "svg") == 0) {
-        image_type = SVG_TYPE;
-    } else if(strcasecmp(filetype, "xpm") == 0) {
-        image_type = XPM_TYPE;
-    } else if(strcasecmp(filetype, "ansi") == 0) {
-        image_type = ANSI_TYPE;
-    } else if(strcasecmp(filetype, "ansi256") == 0) {
-        image_type = ANSI256_TYPE;
-    } else if(strcasecmp(filetype, "asciii") == 0) {
-        image_type = ASCIIi_TYPE;
-    } else if(strcasecmp(filetype, "ascii") == 0) {
-        image_type = ASCII_TYPE;
-    } else if(strcasecmp(filetype, "utf8") == 0) {
-        image_type = UTF8_TYPE;
-    } else if(strcasecmp(filetype, "ansiutf8") == 0) {
-        image_type = ANSIUTF8_TYPE;
-    } else {
-        image_type = PNG_TYPE;
+    Tcl_MutexLock(&qrencodeMutex);
+    if(getImageType(filetype, &defaultConfig.image_type) != 0) {
+        defaultConfig.image_type = PNG_TYPE;
     }
+    Tcl_MutexUnlock(&qrencodeMutex);
 
     return TCL_OK;   
 }
@@ -1355,15 +2445,21 @@ int SETVERSION (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *co
         return TCL_ERROR;
     }
         
-    if(!micro) {
-        if(m_version < 0 && m_version > QRSPEC_VERSION_MAX)
+    Tcl_MutexLock(&qrencodeMutex);
+    if(!defaultConfig.micro) {
+        if(m_version < 0 && m_version > QRSPEC_VERSION_MAX) {
+            Tcl_MutexUnlock(&qrencodeMutex);
             return TCL_ERROR;
+        }
     } else {
-        if(m_version < 0 && m_version > MQRSPEC_VERSION_MAX)
-            return TCL_ERROR;      
+        if(m_version < 0 && m_version > MQRSPEC_VERSION_MAX) {
+            Tcl_MutexUnlock(&qrencodeMutex);
+            return TCL_ERROR;
+        }
     }
         
-    version = m_version;
+    defaultConfig.version = m_version;
+    Tcl_MutexUnlock(&qrencodeMutex);
     
     
     return TCL_OK;    
@@ -1387,9 +2483,12 @@ int SETFOREGROUND (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj
         return TCL_ERROR;
     }
         
-    if(color_set(fg_color, color)) {
+    Tcl_MutexLock(&qrencodeMutex);
+    if(color_set(defaultConfig.fg_color, color)) {
+        Tcl_MutexUnlock(&qrencodeMutex);
         return TCL_ERROR;
     }	
+    Tcl_MutexUnlock(&qrencodeMutex);
     
     return TCL_OK;    
 }
@@ -1412,76 +2511,1618 @@ int SETBACKGROUND (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj
         return TCL_ERROR;
     }
         
-    if(color_set(bg_color, color)) {
+    Tcl_MutexLock(&qrencodeMutex);
+    if(color_set(defaultConfig.bg_color, color)) {
+        Tcl_MutexUnlock(&qrencodeMutex);
         return TCL_ERROR;
     }	
+    Tcl_MutexUnlock(&qrencodeMutex);
     
     return TCL_OK;    
 }
 
 
 
-int QRENCODE (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const obj[])
+/*
+ * Validate the settings before an encode and resolve the quiet zone width
+ * for the symbol type into *resolved.
+ */
+static int checkConfig(Tcl_Interp *interp, const EncoderConfig *cfg, EncoderConfig *resolved)
+{
+    if(cfg->micro && cfg->version > MQRSPEC_VERSION_MAX) {
+        Tcl_SetResult(interp, "version is out of range for Micro QR Code", TCL_STATIC);
+        return TCL_ERROR;
+    } else if(!cfg->micro && cfg->version > QRSPEC_VERSION_MAX) {
+        Tcl_SetResult(interp, "version is out of range", TCL_STATIC);
+        return TCL_ERROR;
+    }
+
+    if(cfg->micro) {
+        // Version must be specified to encode a Micro QR Code symbol
+        if(cfg->version == 0) {
+            Tcl_SetResult(interp, "version must be specified for Micro QR Code", TCL_STATIC);
+            return TCL_ERROR;
+        }
+
+        // Micro QR Code does not support structured symbols
+        if(cfg->structured) {
+            Tcl_SetResult(interp, "Micro QR Code does not support structured symbols", TCL_STATIC);
+            return TCL_ERROR;
+        }
+    }
+
+    *resolved = *cfg;
+    if(resolved->margin < 0) {
+        resolved->margin = cfg->micro ? 2 : 4;
+    }
+
+    return TCL_OK;
+}
+
+
+static int encodeToFile(Tcl_Interp *interp, const EncoderConfig *config, Tcl_Obj *textObj, Tcl_Obj *fileObj)
 {
-    unsigned char *intext = NULL;  
+    Symbols *symbols;
     Tcl_Size len = 0;
     char *outfile = NULL;
-    int length = 0;
     int result = 0;
-    TCL_DECLARE_MUTEX(myMutex);
-    
+    EncoderConfig cfg;
+
+    outfile = Tcl_GetStringFromObj(fileObj, &len);
+    if(!outfile || len < 1) {
+        return TCL_ERROR;
+    }
+
+    if(checkConfig(interp, config, &cfg) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    symbols = getSymbolsFromObj(interp, textObj, &cfg);
+    if(symbols == NULL) {
+        return TCL_ERROR;
+    }
+
+    if(cfg.structured)
+        result = qrencodeStructured(&cfg, symbols, outfile);
+    else {
+        result = qrencode(&cfg, symbols, outfile);
+    }
+    releaseSymbols(symbols);
+
+    if(result > 0) {
+       return TCL_ERROR;
+    }
+
+    return TCL_OK;
+}
+
+
+static int encodeToObj(Tcl_Interp *interp, const EncoderConfig *config, Tcl_Obj *textObj)
+{
+    Symbols *symbols;
+    EncoderConfig cfg;
+    int result;
+
+    if(checkConfig(interp, config, &cfg) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    symbols = getSymbolsFromObj(interp, textObj, &cfg);
+    if(symbols == NULL) {
+        return TCL_ERROR;
+    }
+    result = qrencodeObj(interp, &cfg, symbols);
+    releaseSymbols(symbols);
+
+    return result;
+}
+
+
+static int encodeToChannel(Tcl_Interp *interp, const EncoderConfig *config, Tcl_Obj *textObj, Tcl_Obj *chanObj)
+{
+    Symbols *symbols;
+    Tcl_Channel chan;
+    EncoderConfig cfg;
+    int mode, result;
+
+    chan = Tcl_GetChannel(interp, Tcl_GetString(chanObj), &mode);
+    if(chan == NULL) {
+        return TCL_ERROR;
+    }
+    if(!(mode & TCL_WRITABLE)) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("channel \"%s\" wasn't opened for writing",
+            Tcl_GetString(chanObj)));
+        return TCL_ERROR;
+    }
+
+    if(checkConfig(interp, config, &cfg) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    if(cfg.structured) {
+        Tcl_SetResult(interp, "structured symbols can't be written to a channel", TCL_STATIC);
+        return TCL_ERROR;
+    }
+
+    symbols = getSymbolsFromObj(interp, textObj, &cfg);
+    if(symbols == NULL) {
+        return TCL_ERROR;
+    }
+    result = writeImageChannel(symbols->codes[0], &cfg, chan);
+    releaseSymbols(symbols);
+
+    if(result) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("error writing \"%s\": %s",
+            Tcl_GetString(chanObj), Tcl_PosixError(interp)));
+        return TCL_ERROR;
+    }
+
+    return TCL_OK;
+}
+
+
+/*
+ * Describe the module matrix of a symbol as a dictionary with the keys
+ * width, version and modules. modules is a bytearray with one bit per
+ * module, row-major and packed without padding between rows: module (x, y)
+ * is bit 7 - (n % 8) of byte n / 8 where n = y * width + x, and a set bit is
+ * a dark module.
+ */
+static Tcl_Obj *getMatrixObj(const QRcode *qrcode)
+{
+	Tcl_Obj *dict, *modules;
+	unsigned char *p, *q;
+	int i, n;
+
+	n = qrcode->width * qrcode->width;
+	modules = Tcl_NewByteArrayObj(NULL, 0);
+	q = Tcl_SetByteArrayLength(modules, (n + 7) / 8);
+	memset(q, 0, (n + 7) / 8);
+
+	p = qrcode->data;
+	for(i = 0; i < n; i++) {
+		if(p[i] & 1) {
+			q[i >> 3] |= 0x80 >> (i & 7);
+		}
+	}
+
+	dict = Tcl_NewDictObj();
+	Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("width", -1), Tcl_NewIntObj(qrcode->width));
+	Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("version", -1), Tcl_NewIntObj(qrcode->version));
+	Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("modules", -1), modules);
+
+	return dict;
+}
+
+
+static int encodeToMatrix(Tcl_Interp *interp, const EncoderConfig *config, Tcl_Obj *textObj)
+{
+	Symbols *symbols;
+	EncoderConfig cfg;
+	Tcl_Obj *list;
+	int i;
+
+	if(checkConfig(interp, config, &cfg) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	symbols = getSymbolsFromObj(interp, textObj, &cfg);
+	if(symbols == NULL) {
+		return TCL_ERROR;
+	}
+
+	if(cfg.structured) {
+		list = Tcl_NewListObj(0, NULL);
+		for(i = 0; i < symbols->count; i++) {
+			Tcl_ListObjAppendElement(NULL, list, getMatrixObj(symbols->codes[i]));
+		}
+		Tcl_SetObjResult(interp, list);
+	} else {
+		Tcl_SetObjResult(interp, getMatrixObj(symbols->codes[0]));
+	}
+	releaseSymbols(symbols);
+
+	return TCL_OK;
+}
+
+
+/*
+ * Size the symbol for the payload of textObj without encoding it. The
+ * result tells the version and width, and how many data bits the payload
+ * takes and how many are left. Structured symbols are not considered.
+ */
+static int measureText(Tcl_Interp *interp, const EncoderConfig *config, Tcl_Obj *textObj)
+{
+	EncoderConfig cfg, textCfg;
+	const EncoderConfig *cfgPtr;
+	QRcode_Measure m;
+	const unsigned char *intext;
+	unsigned char *sjis;
+	Tcl_Obj *dict;
+	int length, binary, ret;
+
+	if(checkConfig(interp, config, &cfg) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	intext = getPayload(textObj, &cfg, &length, &binary);
+	if(length < 1) {
+		Tcl_SetResult(interp, "empty string", TCL_STATIC);
+		return TCL_ERROR;
+	}
+	cfgPtr = &cfg;
+	ret = convertText(&cfgPtr, &textCfg, &intext, &length, &sjis);
+	if(ret == 0) {
+		ret = measureSymbol(cfgPtr, intext, length, &m);
+	}
+	free(sjis);
+	if(ret < 0) {
+		setEncodeError(interp);
+		return TCL_ERROR;
+	}
+
+	dict = Tcl_NewDictObj();
+	Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("version", -1), Tcl_NewIntObj(m.version));
+	Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("width", -1), Tcl_NewIntObj(m.width));
+	Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("bits", -1), Tcl_NewIntObj(m.bits));
+	Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("remaining", -1), Tcl_NewIntObj(m.capacity - m.bits));
+	Tcl_SetObjResult(interp, dict);
+
+	return TCL_OK;
+}
+
+
+/*
+ * Take a snapshot of the settings made by the ::qrencode::set* commands, so
+ * that the encode itself can run without holding qrencodeMutex.
+ */
+static void getDefaultConfig(EncoderConfig *cfg)
+{
+    Tcl_MutexLock(&qrencodeMutex);
+    *cfg = defaultConfig;
+    Tcl_MutexUnlock(&qrencodeMutex);
+}
+
+
+int QRENCODE (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const obj[])
+{
+    EncoderConfig cfg;
+
     if(objc != 3)
     {
         Tcl_WrongNumArgs(interp, 1, obj, "string filename");
         return TCL_ERROR;
     }  
 
-    intext = (unsigned char *) Tcl_GetStringFromObj(obj[1], &len);
-    if(!intext || len < 1) {
+    getDefaultConfig(&cfg);
+
+    return encodeToFile(interp, &cfg, obj[1], obj[2]);
+}
+
+
+int QRRENDER (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const obj[])
+{
+    EncoderConfig cfg;
+
+    if(objc != 2)
+    {
+        Tcl_WrongNumArgs(interp, 1, obj, "string");
         return TCL_ERROR;
     }
-    length = strlen((char *)intext);
-    
-    outfile = Tcl_GetStringFromObj(obj[2], &len);
-    if(!outfile || len < 1) {
+
+    getDefaultConfig(&cfg);
+
+    return encodeToObj(interp, &cfg, obj[1]);
+}
+
+
+int QRWRITE (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const obj[])
+{
+    EncoderConfig cfg;
+
+    if(objc != 3)
+    {
+        Tcl_WrongNumArgs(interp, 1, obj, "string channelId");
         return TCL_ERROR;
     }
-    
-    if(micro && version > MQRSPEC_VERSION_MAX) {
+
+    getDefaultConfig(&cfg);
+
+    return encodeToChannel(interp, &cfg, obj[1], obj[2]);
+}
+
+
+/*
+ * Encoder objects
+ */
+
+static const char *const encoderOptions[] = {
+    "-background", "-casesensitive", "-dpi", "-eightbit", "-foreground",
+    "-kanji", "-level", "-margin", "-micro", "-optimize", "-rle", "-size",
+    "-structured", "-type", "-version", NULL
+};
+
+enum encoderOption {
+    OPT_BACKGROUND, OPT_CASESENSITIVE, OPT_DPI, OPT_EIGHTBIT, OPT_FOREGROUND,
+    OPT_KANJI, OPT_LEVEL, OPT_MARGIN, OPT_MICRO, OPT_OPTIMIZE, OPT_RLE, OPT_SIZE,
+    OPT_STRUCTURED, OPT_TYPE, OPT_VERSION
+};
+
+static const char *const levelNames[] = {
+    "L", "M", "Q", "H", NULL
+};
+
+static int getLevelFromObj(Tcl_Interp *interp, Tcl_Obj *objPtr, QRecLevel *level)
+{
+    int index;
+
+    if(Tcl_GetIntFromObj(NULL, objPtr, &index) == TCL_OK) {
+        if(index < 0 || index > 3) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("bad level \"%s\": must be 0-3",
+                Tcl_GetString(objPtr)));
+            return TCL_ERROR;
+        }
+    } else if(Tcl_GetIndexFromObj(interp, objPtr, levelNames, "level", 0, &index) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    *level = (QRecLevel)index;
+
+    return TCL_OK;
+}
+
+static Tcl_Obj *getColorObj(const unsigned char color[4])
+{
+    if(color[3] == 255) {
+        return Tcl_ObjPrintf("%02x%02x%02x", color[0], color[1], color[2]);
+    }
+    return Tcl_ObjPrintf("%02x%02x%02x%02x", color[0], color[1], color[2], color[3]);
+}
+
+static Tcl_Obj *getEncoderOption(const EncoderConfig *cfg, int option)
+{
+    switch((enum encoderOption)option) {
+        case OPT_BACKGROUND:
+            return getColorObj(cfg->bg_color);
+        case OPT_CASESENSITIVE:
+            return Tcl_NewBooleanObj(cfg->casesensitive);
+        case OPT_DPI:
+            return Tcl_NewIntObj(cfg->dpi);
+        case OPT_EIGHTBIT:
+            return Tcl_NewBooleanObj(cfg->eightbit);
+        case OPT_FOREGROUND:
+            return getColorObj(cfg->fg_color);
+        case OPT_KANJI:
+            return Tcl_NewBooleanObj(cfg->hint == QR_MODE_KANJI);
+        case OPT_LEVEL:
+            return Tcl_NewStringObj(levelNames[cfg->level], -1);
+        case OPT_MARGIN:
+            return Tcl_NewIntObj(cfg->margin);
+        case OPT_MICRO:
+            return Tcl_NewBooleanObj(cfg->micro);
+        case OPT_OPTIMIZE:
+            return Tcl_NewBooleanObj(cfg->optimize);
+        case OPT_RLE:
+            return Tcl_NewBooleanObj(cfg->rle);
+        case OPT_SIZE:
+            return Tcl_NewIntObj(cfg->size);
+        case OPT_STRUCTURED:
+            return Tcl_NewBooleanObj(cfg->structured);
+        case OPT_TYPE:
+            return Tcl_NewStringObj(imageTypeNames[cfg->image_type], -1);
+        case OPT_VERSION:
+            return Tcl_NewIntObj(cfg->version);
+    }
+
+    return NULL;
+}
+
+/*
+ * Apply "-option value" pairs to cfg. cfg is only modified when all of the
+ * options are valid.
+ */
+static int configureEncoder(Tcl_Interp *interp, EncoderConfig *cfg, int objc, Tcl_Obj *const objv[])
+{
+    EncoderConfig newcfg = *cfg;
+    int i, option, value, type;
+
+    if(objc & 1) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("value for \"%s\" missing",
+            Tcl_GetString(objv[objc - 1])));
         return TCL_ERROR;
-    } else if(!micro && version > QRSPEC_VERSION_MAX) {
+    }
+
+    for(i = 0; i < objc; i += 2) {
+        if(Tcl_GetIndexFromObj(interp, objv[i], encoderOptions, "option", 0, &option) != TCL_OK) {
+            return TCL_ERROR;
+        }
+
+        switch((enum encoderOption)option) {
+            case OPT_BACKGROUND:
+            case OPT_FOREGROUND:
+                if(color_set(option == OPT_BACKGROUND ? newcfg.bg_color : newcfg.fg_color,
+                        Tcl_GetString(objv[i + 1]))) {
+                    Tcl_SetObjResult(interp, Tcl_ObjPrintf("bad color \"%s\": must be RRGGBB or RRGGBBAA",
+                        Tcl_GetString(objv[i + 1])));
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_LEVEL:
+                if(getLevelFromObj(interp, objv[i + 1], &newcfg.level) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+                break;
+            case OPT_TYPE:
+                if(Tcl_GetIndexFromObj(interp, objv[i + 1], imageTypeNames, "type", 0, &type) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+                newcfg.image_type = (enum imageType)type;
+                break;
+            case OPT_CASESENSITIVE:
+            case OPT_EIGHTBIT:
+            case OPT_KANJI:
+            case OPT_MICRO:
+            case OPT_OPTIMIZE:
+            case OPT_RLE:
+            case OPT_STRUCTURED:
+                if(Tcl_GetBooleanFromObj(interp, objv[i + 1], &value) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+                if(option == OPT_CASESENSITIVE) newcfg.casesensitive = value;
+                else if(option == OPT_EIGHTBIT) newcfg.eightbit = value;
+                else if(option == OPT_KANJI) newcfg.hint = value ? QR_MODE_KANJI : QR_MODE_8;
+                else if(option == OPT_MICRO) newcfg.micro = value;
+                else if(option == OPT_OPTIMIZE) newcfg.optimize = value;
+                else if(option == OPT_RLE) newcfg.rle = value;
+                else newcfg.structured = value;
+                break;
+            case OPT_DPI:
+            case OPT_MARGIN:
+            case OPT_SIZE:
+            case OPT_VERSION:
+                if(Tcl_GetIntFromObj(interp, objv[i + 1], &value) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+                if((option == OPT_DPI || option == OPT_SIZE) && value <= 0) {
+                    Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s must be a positive integer",
+                        encoderOptions[option]));
+                    return TCL_ERROR;
+                }
+                if(option == OPT_VERSION && (value < 0 || value > QRSPEC_VERSION_MAX)) {
+                    Tcl_SetObjResult(interp, Tcl_ObjPrintf("bad version \"%d\": must be 0-%d",
+                        value, QRSPEC_VERSION_MAX));
+                    return TCL_ERROR;
+                }
+                if(option == OPT_DPI) newcfg.dpi = value;
+                else if(option == OPT_MARGIN) newcfg.margin = (value < 0) ? -1 : value;
+                else if(option == OPT_SIZE) newcfg.size = value;
+                else newcfg.version = value;
+                break;
+        }
+    }
+
+    *cfg = newcfg;
+
+    return TCL_OK;
+}
+
+static int cgetEncoder(Tcl_Interp *interp, const EncoderConfig *cfg, Tcl_Obj *optionObj)
+{
+    int option;
+
+    if(Tcl_GetIndexFromObj(interp, optionObj, encoderOptions, "option", 0, &option) != TCL_OK) {
         return TCL_ERROR;
-    }    
-    
-    if(micro) {
-        margin = 2;
-    } else {
-        margin = 4;
     }
-    
-    if(micro) {
-        // Version must be specified to encode a Micro QR Code symbol
-        if(version == 0) {
-	  return TCL_ERROR;
-	}
-	
-        // Micro QR Code does not support structured symbols
-        if(structured) {
-	  return TCL_ERROR;
-	}	
+    Tcl_SetObjResult(interp, getEncoderOption(cfg, option));
+
+    return TCL_OK;
+}
+
+static Tcl_Obj *getEncoderOptions(const EncoderConfig *cfg)
+{
+    Tcl_Obj *list;
+    int i;
+
+    list = Tcl_NewListObj(0, NULL);
+    for(i = 0; encoderOptions[i] != NULL; i++) {
+        Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj(encoderOptions[i], -1));
+        Tcl_ListObjAppendElement(NULL, list, getEncoderOption(cfg, i));
     }
-    
-    Tcl_MutexLock(&myMutex);
-    if(structured)
-        result = qrencodeStructured(intext, length, outfile);
-    else {  
-        result = qrencode(intext, length, outfile);
+
+    return list;
+}
+
+typedef struct {
+    EncoderConfig config;
+    Tcl_Command token;
+} Encoder;
+
+static void EncoderDeleteCmd(ClientData clientData)
+{
+    Encoder *encoder = (Encoder *) clientData;
+
+    ckfree((char *) encoder);
+}
+
+static int EncoderObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const obj[])
+{
+    Encoder *encoder = (Encoder *) clientData;
+    int method;
+
+    static const char *const methods[] = {
+        "cget", "configure", "destroy", "encode", "matrix", "measure", "render",
+        "write", NULL
+    };
+    enum methods {
+        M_CGET, M_CONFIGURE, M_DESTROY, M_ENCODE, M_MATRIX, M_MEASURE, M_RENDER,
+        M_WRITE
+    };
+
+    if(objc < 2) {
+        Tcl_WrongNumArgs(interp, 1, obj, "method ?arg ...?");
+        return TCL_ERROR;
     }
-    Tcl_MutexUnlock(&myMutex);
 
-    if(result > 0) {
-       return TCL_ERROR;
+    if(Tcl_GetIndexFromObj(interp, obj[1], methods, "method", 0, &method) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    switch((enum methods)method) {
+        case M_CGET:
+            if(objc != 3) {
+                Tcl_WrongNumArgs(interp, 2, obj, "option");
+                return TCL_ERROR;
+            }
+            return cgetEncoder(interp, &encoder->config, obj[2]);
+        case M_CONFIGURE:
+            if(objc == 2) {
+                Tcl_SetObjResult(interp, getEncoderOptions(&encoder->config));
+                return TCL_OK;
+            } else if(objc == 3) {
+                return cgetEncoder(interp, &encoder->config, obj[2]);
+            }
+            return configureEncoder(interp, &encoder->config, objc - 2, obj + 2);
+        case M_DESTROY:
+            if(objc != 2) {
+                Tcl_WrongNumArgs(interp, 2, obj, NULL);
+                return TCL_ERROR;
+            }
+            Tcl_DeleteCommandFromToken(interp, encoder->token);
+            return TCL_OK;
+        case M_ENCODE:
+            if(objc != 4) {
+                Tcl_WrongNumArgs(interp, 2, obj, "string filename");
+                return TCL_ERROR;
+            }
+            return encodeToFile(interp, &encoder->config, obj[2], obj[3]);
+        case M_MATRIX:
+            if(objc != 3) {
+                Tcl_WrongNumArgs(interp, 2, obj, "string");
+                return TCL_ERROR;
+            }
+            return encodeToMatrix(interp, &encoder->config, obj[2]);
+        case M_MEASURE:
+            if(objc != 3) {
+                Tcl_WrongNumArgs(interp, 2, obj, "string");
+                return TCL_ERROR;
+            }
+            return measureText(interp, &encoder->config, obj[2]);
+        case M_RENDER:
+            if(objc != 3) {
+                Tcl_WrongNumArgs(interp, 2, obj, "string");
+                return TCL_ERROR;
+            }
+            return encodeToObj(interp, &encoder->config, obj[2]);
+        case M_WRITE:
+            if(objc != 4) {
+                Tcl_WrongNumArgs(interp, 2, obj, "string channelId");
+                return TCL_ERROR;
+            }
+            return encodeToChannel(interp, &encoder->config, obj[2], obj[3]);
+    }
+
+    return TCL_OK;
+}
+
+
+int QRCREATE (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const obj[])
+{
+    Encoder *encoder;
+    EncoderConfig cfg = ENCODER_CONFIG_INIT;
+    Tcl_Obj *nameObj;
+
+    if(objc < 2)
+    {
+        Tcl_WrongNumArgs(interp, 1, obj, "name ?-option value ...?");
+        return TCL_ERROR;
+    }
+
+    if(configureEncoder(interp, &cfg, objc - 2, obj + 2) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    encoder = (Encoder *) ckalloc(sizeof(Encoder));
+    encoder->config = cfg;
+    encoder->token = Tcl_CreateObjCommand(interp, Tcl_GetString(obj[1]),
+        EncoderObjCmd, (ClientData) encoder, EncoderDeleteCmd);
+
+    nameObj = Tcl_NewObj();
+    Tcl_GetCommandFullName(interp, encoder->token, nameObj);
+    Tcl_SetObjResult(interp, nameObj);
+
+    return TCL_OK;
+}
+
+
+int QRMATRIX (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const obj[])
+{
+    EncoderConfig cfg;
+
+    if(objc < 2)
+    {
+        Tcl_WrongNumArgs(interp, 1, obj, "string ?-option value ...?");
+        return TCL_ERROR;
+    }
+
+    getDefaultConfig(&cfg);
+    if(configureEncoder(interp, &cfg, objc - 2, obj + 2) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    return encodeToMatrix(interp, &cfg, obj[1]);
+}
+
+
+int QRMEASURE (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const obj[])
+{
+    EncoderConfig cfg;
+
+    if(objc < 2)
+    {
+        Tcl_WrongNumArgs(interp, 1, obj, "string ?-option value ...?");
+        return TCL_ERROR;
+    }
+
+    getDefaultConfig(&cfg);
+    if(configureEncoder(interp, &cfg, objc - 2, obj + 2) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    return measureText(interp, &cfg, obj[1]);
+}
+
+
+int QRCACHE (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const obj[])
+{
+    Tcl_Obj *stats;
+    Symbols **freeList = NULL;
+    CacheShard *shard;
+    Tcl_WideInt maxbytes, hits = 0, misses = 0, evictions = 0;
+    int i, entries = 0, nfree = 0, method, option;
+
+    static const char *const methods[] = {
+        "clear", "configure", "stats", NULL
+    };
+    enum methods {
+        M_CLEAR, M_CONFIGURE, M_STATS
+    };
+    static const char *const options[] = {
+        "-maxbytes", NULL
+    };
+
+    if(objc < 2)
+    {
+        Tcl_WrongNumArgs(interp, 1, obj, "clear|configure|stats ?arg ...?");
+        return TCL_ERROR;
+    }
+
+    if(Tcl_GetIndexFromObj(interp, obj[1], methods, "method", 0, &method) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    switch((enum methods)method) {
+        case M_CLEAR:
+            if(objc != 2) {
+                Tcl_WrongNumArgs(interp, 2, obj, NULL);
+                return TCL_ERROR;
+            }
+            trimCache(0, 0, &freeList, &nfree);
+            for(i = 0; i < SYMBOL_CACHE_SHARDS; i++) {
+                shard = &symbolCache.shards[i];
+                Tcl_MutexLock(&shard->mutex);
+                shard->hits = shard->misses = shard->evictions = 0;
+                Tcl_MutexUnlock(&shard->mutex);
+            }
+            freeSymbolList(freeList, nfree);
+            return TCL_OK;
+        case M_CONFIGURE:
+            if(objc == 2 || objc == 3) {
+                if(objc == 3 && Tcl_GetIndexFromObj(interp, obj[2], options, "option", 0, &option) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+                maxbytes = QRatomic_loadWide(&symbolCache.maxbytes);
+                if(objc == 2) {
+                    Tcl_SetObjResult(interp, Tcl_NewListObj(0, NULL));
+                    Tcl_ListObjAppendElement(NULL, Tcl_GetObjResult(interp), Tcl_NewStringObj("-maxbytes", -1));
+                    Tcl_ListObjAppendElement(NULL, Tcl_GetObjResult(interp), Tcl_NewWideIntObj(maxbytes));
+                } else {
+                    Tcl_SetObjResult(interp, Tcl_NewWideIntObj(maxbytes));
+                }
+                return TCL_OK;
+            }
+            if(objc != 4) {
+                Tcl_WrongNumArgs(interp, 2, obj, "?-maxbytes ?bytes??");
+                return TCL_ERROR;
+            }
+            if(Tcl_GetIndexFromObj(interp, obj[2], options, "option", 0, &option) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            if(Tcl_GetWideIntFromObj(interp, obj[3], &maxbytes) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            if(maxbytes < 0) {
+                Tcl_SetResult(interp, "-maxbytes must not be negative", TCL_STATIC);
+                return TCL_ERROR;
+            }
+            QRatomic_storeWide(&symbolCache.maxbytes, maxbytes);
+            trimCache(maxbytes, 0, &freeList, &nfree);
+            freeSymbolList(freeList, nfree);
+            return TCL_OK;
+        case M_STATS:
+            if(objc != 2) {
+                Tcl_WrongNumArgs(interp, 2, obj, NULL);
+                return TCL_ERROR;
+            }
+            for(i = 0; i < SYMBOL_CACHE_SHARDS; i++) {
+                shard = &symbolCache.shards[i];
+                Tcl_MutexLock(&shard->mutex);
+                entries += shard->initialized ? shard->table.numEntries : 0;
+                hits += shard->hits;
+                misses += shard->misses;
+                evictions += shard->evictions;
+                Tcl_MutexUnlock(&shard->mutex);
+            }
+            stats = Tcl_NewDictObj();
+            Tcl_DictObjPut(NULL, stats, Tcl_NewStringObj("entries", -1), Tcl_NewIntObj(entries));
+            Tcl_DictObjPut(NULL, stats, Tcl_NewStringObj("bytes", -1), Tcl_NewWideIntObj(QRatomic_loadWide(&symbolCache.bytes)));
+            Tcl_DictObjPut(NULL, stats, Tcl_NewStringObj("maxbytes", -1), Tcl_NewWideIntObj(QRatomic_loadWide(&symbolCache.maxbytes)));
+            Tcl_DictObjPut(NULL, stats, Tcl_NewStringObj("hits", -1), Tcl_NewWideIntObj(hits));
+            Tcl_DictObjPut(NULL, stats, Tcl_NewStringObj("misses", -1), Tcl_NewWideIntObj(misses));
+            Tcl_DictObjPut(NULL, stats, Tcl_NewStringObj("evictions", -1), Tcl_NewWideIntObj(evictions));
+            Tcl_SetObjResult(interp, stats);
+            return TCL_OK;
+    }
+
+    return TCL_OK;
+}
+
+
+static Tcl_Obj *getStatsObj(void)
+{
+    static const char *const stages[QRSTATS_STAGES] = {
+        "split", "bitstream", "rsecc", "fill", "mask", "write"
+    };
+    Tcl_Obj *result, *dict, *stage;
+    QRstats stats;
+    char name[8];
+    int i;
+
+    QRstats_get(&stats);
+
+    result = Tcl_NewDictObj();
+    Tcl_DictObjPut(NULL, result, Tcl_NewStringObj("enabled", -1), Tcl_NewBooleanObj(QRstats_isEnabled()));
+    Tcl_DictObjPut(NULL, result, Tcl_NewStringObj("encodes", -1), Tcl_NewWideIntObj(stats.encodes));
+    Tcl_DictObjPut(NULL, result, Tcl_NewStringObj("failures", -1), Tcl_NewWideIntObj(stats.failures));
+
+    dict = Tcl_NewDictObj();
+    for(i = 0; i < QRSTATS_STAGES; i++) {
+        stage = Tcl_NewDictObj();
+        Tcl_DictObjPut(NULL, stage, Tcl_NewStringObj("calls", -1), Tcl_NewWideIntObj(stats.total.calls[i]));
+        Tcl_DictObjPut(NULL, stage, Tcl_NewStringObj("total", -1), Tcl_NewWideIntObj(stats.total.time[i]));
+        Tcl_DictObjPut(NULL, stage, Tcl_NewStringObj("last", -1), Tcl_NewWideIntObj(stats.last.time[i]));
+        Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj(stages[i], -1), stage);
+    }
+    Tcl_DictObjPut(NULL, result, Tcl_NewStringObj("stages", -1), dict);
+
+    dict = Tcl_NewDictObj();
+    for(i = 1; i < QRSTATS_VERSIONS; i++) {
+        if(stats.versions[i] == 0) continue;
+        Tcl_DictObjPut(NULL, dict, Tcl_NewIntObj(i), Tcl_NewWideIntObj(stats.versions[i]));
+    }
+    for(i = 1; i < QRSTATS_MQR_VERSIONS; i++) {
+        if(stats.mqrVersions[i] == 0) continue;
+        sprintf(name, "M%d", i);
+        Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj(name, -1), Tcl_NewWideIntObj(stats.mqrVersions[i]));
+    }
+    Tcl_DictObjPut(NULL, result, Tcl_NewStringObj("versions", -1), dict);
+
+    dict = Tcl_NewDictObj();
+    for(i = 0; i < 8; i++) {
+        if(stats.masks[i] == 0) continue;
+        Tcl_DictObjPut(NULL, dict, Tcl_NewIntObj(i), Tcl_NewWideIntObj(stats.masks[i]));
+    }
+    for(i = 0; i < 4; i++) {
+        if(stats.mqrMasks[i] == 0) continue;
+        sprintf(name, "M%d", i);
+        Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj(name, -1), Tcl_NewWideIntObj(stats.mqrMasks[i]));
+    }
+    Tcl_DictObjPut(NULL, result, Tcl_NewStringObj("masks", -1), dict);
+
+    return result;
+}
+
+
+int QRSTATS (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const obj[])
+{
+    int method = 0;
+
+    static const char *const methods[] = {
+        "disable", "enable", "get", "reset", NULL
+    };
+    enum methods {
+        M_DISABLE, M_ENABLE, M_GET, M_RESET
+    };
+
+    if(objc > 2)
+    {
+        Tcl_WrongNumArgs(interp, 1, obj, "?disable|enable|get|reset?");
+        return TCL_ERROR;
+    }
+
+    if(objc == 2 && Tcl_GetIndexFromObj(interp, obj[1], methods, "method", 0, &method) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if(objc == 1) {
+        method = M_GET;
+    }
+
+    switch((enum methods)method) {
+        case M_DISABLE:
+            QRatomic_storeLong(&QRstats_enabled, 0);
+            break;
+        case M_ENABLE:
+            QRatomic_storeLong(&QRstats_enabled, 1);
+            break;
+        case M_GET:
+            Tcl_SetObjResult(interp, getStatsObj());
+            break;
+        case M_RESET:
+            QRstats_reset();
+            break;
+    }
+
+    return TCL_OK;
+}
+
+
+/*
+ * Batch encoding
+ *
+ * The items of a batch are encoded and rendered into memory by a pool of
+ * native threads. The workers never touch Tcl objects: they read the
+ * string representations and cached symbols that the calling thread
+ * fetched in advance, and write into malloc'ed Output buffers that the
+ * calling thread turns into bytearrays once all workers are joined.
+ */
+
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(HAVE_UNISTD_H)
+#include <unistd.h>
+#endif
+
+#define BATCH_MAX_THREADS (64)
+
+typedef struct {
+	const unsigned char *intext;
+	int length;
+	int binary;		/* intext is a bytearray, see getPayload() */
+	Symbols *symbols;	/* cached on the input, or got by a worker */
+	int encoded;		/* set if a worker got symbols */
+	Output *images;		/* one per symbol */
+	int count;
+	int error;		/* errno of a failed encode, -1 if a writer failed */
+} BatchItem;
+
+typedef struct {
+	const EncoderConfig *cfg;
+	BatchItem *items;
+	int count;
+	int next;		/* first item not taken by a worker yet */
+	Tcl_Mutex mutex;	/* protects next */
+} Batch;
+
+static int getProcessorCount(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+
+	GetSystemInfo(&info);
+	return (int)info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return (n > 0) ? (int)n : 1;
+#else
+	return 1;
+#endif
+}
+
+
+static void renderBatchItem(const EncoderConfig *cfg, BatchItem *item)
+{
+	int i;
+
+	if(item->symbols == NULL) {
+		item->symbols = getSymbols(cfg, item->intext, item->length);
+		if(item->symbols == NULL) {
+			item->error = errno;
+			return;
+		}
+		item->encoded = 1;
+	}
+
+	item->images = (Output *)calloc(item->symbols->count, sizeof(Output));
+	if(item->images == NULL) {
+		item->error = ENOMEM;
+		return;
+	}
+	item->count = item->symbols->count;
+
+	for(i = 0; i < item->count; i++) {
+		openMemoryOutput(&item->images[i]);
+		if(writeImage(item->symbols->codes[i], cfg, &item->images[i]) != 0
+				|| item->images[i].error) {
+			item->error = -1;
+			break;
+		}
+	}
+}
+
+
+static void runBatch(Batch *batch)
+{
+	int i;
+
+	for(;;) {
+		Tcl_MutexLock(&batch->mutex);
+		i = batch->next++;
+		Tcl_MutexUnlock(&batch->mutex);
+
+		if(i >= batch->count) break;
+		renderBatchItem(batch->cfg, &batch->items[i]);
+	}
+}
+
+
+static Tcl_ThreadCreateType batchWorker(ClientData clientData)
+{
+	Mask_setThreadParallel(0);
+	runBatch((Batch *) clientData);
+
+	Tcl_ExitThread(0);
+	TCL_THREAD_CREATE_RETURN;
+}
+
+
+/*
+ * Encode all items with up to nthreads threads, the calling thread being
+ * one of them. If a worker cannot be started the remaining threads simply
+ * take over its share. The threads already run in parallel, so none of
+ * them scores masks in parallel as well.
+ */
+static void encodeBatch(Batch *batch, int nthreads)
+{
+	Tcl_ThreadId threads[BATCH_MAX_THREADS];
+	int i, n = 0, result, parallel;
+
+	if(nthreads > batch->count) nthreads = batch->count;
+	if(nthreads > BATCH_MAX_THREADS) nthreads = BATCH_MAX_THREADS;
+
+	for(i = 1; i < nthreads; i++) {
+		if(Tcl_CreateThread(&threads[n], batchWorker, (ClientData) batch,
+				TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE) != TCL_OK) {
+			break;
+		}
+		n++;
+	}
+
+	parallel = (n > 0) ? Mask_setThreadParallel(0) : 0;
+	runBatch(batch);
+	if(parallel) {
+		Mask_setThreadParallel(1);
+	}
+
+	for(i = 0; i < n; i++) {
+		Tcl_JoinThread(threads[i], &result);
+	}
+}
+
+
+static void freeBatchItem(BatchItem *item)
+{
+	int i;
+
+	for(i = 0; i < item->count; i++) {
+		freeOutput(&item->images[i]);
+	}
+	free(item->images);
+	if(item->symbols != NULL) {
+		releaseSymbols(item->symbols);
+	}
+}
+
+
+static void freeBatch(Batch *batch)
+{
+	int i;
+
+	for(i = 0; i < batch->count; i++) {
+		freeBatchItem(&batch->items[i]);
+	}
+	ckfree((char *) batch->items);
+	Tcl_MutexFinalize(&batch->mutex);
+}
+
+
+/*
+ * Turn a rendered item into a bytearray, or a list of bytearrays when
+ * structured symbols are enabled, or leave the error in the interpreter.
+ */
+static int getBatchItemResult(Tcl_Interp *interp, const EncoderConfig *cfg, const BatchItem *item, Tcl_Obj **resultPtr)
+{
+	Tcl_Obj *images;
+	int i;
+
+	if(item->error > 0) {
+		errno = item->error;
+		setEncodeError(interp);
+		return TCL_ERROR;
+	} else if(item->error < 0) {
+		Tcl_SetResult(interp, "Failed to write the image", TCL_STATIC);
+		return TCL_ERROR;
+	}
+
+	if(cfg->structured) {
+		images = Tcl_NewListObj(0, NULL);
+		for(i = 0; i < item->count; i++) {
+			Tcl_ListObjAppendElement(NULL, images,
+				Tcl_NewByteArrayObj(item->images[i].data, (Tcl_Size)item->images[i].length));
+		}
+	} else {
+		images = Tcl_NewByteArrayObj(item->images[0].data, (Tcl_Size)item->images[0].length);
+	}
+	*resultPtr = images;
+
+	return TCL_OK;
+}
+
+
+int QRENCODEBATCH (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const obj[])
+{
+    EncoderConfig config, cfg;
+    Batch batch;
+    Tcl_Obj **elemv, **optv, *list, *images;
+    Tcl_Size elemc;
+    int i, optc = 0, nthreads = 0, ret = TCL_OK;
+
+    if(objc < 2)
+    {
+        Tcl_WrongNumArgs(interp, 1, obj, "strings ?-threads count? ?-option value ...?");
+        return TCL_ERROR;
+    }
+
+    if(Tcl_ListObjGetElements(interp, obj[1], &elemc, &elemv) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    /* -threads is ours, everything else is an encoder option */
+    optv = (Tcl_Obj **) ckalloc(sizeof(Tcl_Obj *) * objc);
+    for(i = 2; i < objc; i++) {
+        if(strcmp(Tcl_GetString(obj[i]), "-threads") == 0 && i + 1 < objc) {
+            if(Tcl_GetIntFromObj(interp, obj[i + 1], &nthreads) != TCL_OK) {
+                ckfree((char *) optv);
+                return TCL_ERROR;
+            }
+            if(nthreads <= 0) {
+                ckfree((char *) optv);
+                Tcl_SetResult(interp, "-threads must be a positive integer", TCL_STATIC);
+                return TCL_ERROR;
+            }
+            i++;
+        } else {
+            optv[optc++] = obj[i];
+        }
+    }
+
+    getDefaultConfig(&config);
+    ret = configureEncoder(interp, &config, optc, optv);
+    ckfree((char *) optv);
+    if(ret != TCL_OK || checkConfig(interp, &config, &cfg) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if(nthreads == 0) {
+        nthreads = getProcessorCount();
+    }
+
+    batch.cfg = &cfg;
+    batch.count = (int) elemc;
+    batch.next = 0;
+    batch.mutex = NULL;
+    batch.items = (BatchItem *) ckalloc(sizeof(BatchItem) * (elemc > 0 ? elemc : 1));
+    memset(batch.items, 0, sizeof(BatchItem) * (elemc > 0 ? elemc : 1));
+
+    for(i = 0; i < batch.count; i++) {
+        batch.items[i].intext = getPayload(elemv[i], &cfg, &batch.items[i].length,
+            &batch.items[i].binary);
+        if(batch.items[i].length < 1) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("item %d: empty string", i));
+            batch.count = i;
+            freeBatch(&batch);
+            return TCL_ERROR;
+        }
+        batch.items[i].symbols = getCachedSymbols(elemv[i], &cfg);
+        if(batch.items[i].symbols != NULL) {
+            preserveSymbols(batch.items[i].symbols);
+        }
+    }
+
+    encodeBatch(&batch, nthreads);
+
+    /* keep what the workers encoded on the inputs for the next time */
+    for(i = 0; i < batch.count; i++) {
+        if(batch.items[i].encoded && !batch.items[i].binary) {
+            setSymbolsInternalRep(elemv[i], batch.items[i].symbols);
+        }
+    }
+
+    list = Tcl_NewListObj(0, NULL);
+    for(i = 0; i < batch.count; i++) {
+        if(getBatchItemResult(interp, &cfg, &batch.items[i], &images) != TCL_OK) {
+            Tcl_AppendPrintfToObj(Tcl_GetObjResult(interp), " (item %d)", i);
+            ret = TCL_ERROR;
+            break;
+        }
+        Tcl_ListObjAppendElement(NULL, list, images);
+    }
+
+    freeBatch(&batch);
+
+    if(ret != TCL_OK) {
+        Tcl_DecrRefCount(list);
+        return TCL_ERROR;
+    }
+    Tcl_SetObjResult(interp, list);
+
+    return TCL_OK;
+}
+
+
+/*
+ * Parallel mask selection
+ *
+ * Symbols of version 20 or larger score their eight candidate
+ * masks on one thread per processor (up to eight), with helpers from a
+ * pool that is started on first use and shared by all threads. Batch and
+ * async workers score sequentially. The thread count is set once, when
+ * the package is first loaded, and can be changed with
+ * ::qrencode::setparallelmask.
+ */
+
+void initParallelMask(void)
+{
+	static int initialized = 0;
+	int version, threads;
+
+	Tcl_MutexLock(&qrencodeMutex);
+	if(!initialized) {
+		Mask_getParallel(&version, &threads);
+		Mask_setParallel(version, getProcessorCount());
+		initialized = 1;
+	}
+	Tcl_MutexUnlock(&qrencodeMutex);
+}
+
+
+int SETPARALLELMASK (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const obj[])
+{
+    int version, threads;
+
+    if(objc != 2 && objc != 3)
+    {
+        Tcl_WrongNumArgs(interp, 1, obj, "minversion ?threads?");
+        return TCL_ERROR;
+    }
+
+    if(Tcl_GetIntFromObj(interp, obj[1], &version) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if(version < 0 || version > QRSPEC_VERSION_MAX) {
+        Tcl_SetResult(interp, "minversion must be between 0 and 40", TCL_STATIC);
+        return TCL_ERROR;
+    }
+
+    if(objc == 3) {
+        if(Tcl_GetIntFromObj(interp, obj[2], &threads) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        if(threads < 1) {
+            Tcl_SetResult(interp, "threads must be positive", TCL_STATIC);
+            return TCL_ERROR;
+        }
+    } else {
+        threads = getProcessorCount();
+    }
+
+    initParallelMask();
+    Mask_setParallel(version, threads);
+
+    return TCL_OK;
+}
+
+
+int SETARENA (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const obj[])
+{
+    int enabled;
+
+    if(objc != 1 && objc != 2)
+    {
+        Tcl_WrongNumArgs(interp, 1, obj, "?boolean?");
+        return TCL_ERROR;
+    }
+
+    if(objc == 2) {
+        if(Tcl_GetBooleanFromObj(interp, obj[1], &enabled) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        QRatomic_storeLong(&QRarena_enabled, (long)enabled);
+    }
+
+    Tcl_SetObjResult(interp, Tcl_NewBooleanObj(QRatomic_loadLong(&QRarena_enabled)));
+    return TCL_OK;
+}
+
+
+/*
+ * Asynchronous encoding
+ *
+ * Jobs are encoded and rendered by a pool of up to one native thread per
+ * processor, then handed back to the thread of the interpreter with
+ * Tcl_ThreadQueueEvent, where the callback runs from the event loop. The
+ * workers are started when jobs are waiting and none is idle, and joined
+ * at exit.
+ *
+ * Each thread keeps a list of its jobs that have not been serviced yet. If
+ * it exits first, its exit handler drops the Tcl_Obj references and the
+ * interpreter of those jobs, deletes their events and frees them, or, for
+ * jobs that are still being encoded, leaves freeing the rest to the
+ * worker. The state of a job is protected by the pool mutex.
+ */
+
+typedef enum {
+	ASYNC_QUEUED,	/* waiting for a worker */
+	ASYNC_RUNNING,	/* taken by a worker */
+	ASYNC_DONE,	/* its event is queued to the owner */
+	ASYNC_ORPHANED	/* running, but the owner has exited */
+} AsyncState;
+
+typedef struct AsyncJob {
+	BatchItem item;
+	EncoderConfig cfg;
+	unsigned char *intext;	/* private copy of the payload */
+	Tcl_ThreadId owner;
+	Tcl_Interp *interp;	/* only used in the owner thread */
+	Tcl_Obj *payload;
+	Tcl_Obj *callback;
+	AsyncState state;
+	struct AsyncJob *nextQueued;
+	struct AsyncJob *prevPending;	/* the owner's list, see AsyncThreadData */
+	struct AsyncJob *nextPending;
+} AsyncJob;
+
+typedef struct {
+	Tcl_Event header;
+	AsyncJob *job;
+} AsyncEvent;
+
+typedef struct {
+	AsyncJob *pending;
+	int initialized;
+} AsyncThreadData;
+
+static Tcl_ThreadDataKey asyncDataKey;
+
+static struct {
+	Tcl_Mutex mutex;
+	Tcl_Condition work;
+	AsyncJob *head;
+	AsyncJob *tail;
+	int workers;
+	int idle;
+	int shutdown;
+	Tcl_ThreadId threads[BATCH_MAX_THREADS];
+} asyncPool;
+
+/* The part of a job that any thread may free. */
+static void freeAsyncJobData(AsyncJob *job)
+{
+	freeBatchItem(&job->item);
+	ckfree((char *) job->intext);
+	ckfree((char *) job);
+}
+
+
+/* The part of a job that only the owner thread may release. */
+static void releaseAsyncJob(AsyncJob *job)
+{
+	AsyncThreadData *tsdPtr = (AsyncThreadData *) Tcl_GetThreadData(&asyncDataKey, sizeof(AsyncThreadData));
+
+	if(job->prevPending != NULL) {
+		job->prevPending->nextPending = job->nextPending;
+	} else {
+		tsdPtr->pending = job->nextPending;
+	}
+	if(job->nextPending != NULL) {
+		job->nextPending->prevPending = job->prevPending;
+	}
+	Tcl_DecrRefCount(job->payload);
+	Tcl_DecrRefCount(job->callback);
+	Tcl_Release((ClientData) job->interp);
+}
+
+
+static int asyncEventProc(Tcl_Event *evPtr, int flags)
+{
+	AsyncJob *job = ((AsyncEvent *) evPtr)->job;
+	Tcl_Interp *interp = job->interp;
+	Tcl_Obj *cmd, *images;
+	int code;
+
+	if(!(flags & TCL_FILE_EVENTS)) {
+		return 0;
+	}
+
+	if(!Tcl_InterpDeleted(interp)) {
+		if(job->item.encoded && !job->item.binary) {
+			setSymbolsInternalRep(job->payload, job->item.symbols);
+		}
+
+		Tcl_Preserve((ClientData) interp);
+		cmd = Tcl_DuplicateObj(job->callback);
+		Tcl_IncrRefCount(cmd);
+		if(getBatchItemResult(interp, &job->cfg, &job->item, &images) == TCL_OK) {
+			Tcl_ListObjAppendElement(NULL, cmd, Tcl_NewStringObj("ok", -1));
+			Tcl_ListObjAppendElement(NULL, cmd, images);
+		} else {
+			Tcl_ListObjAppendElement(NULL, cmd, Tcl_NewStringObj("error", -1));
+			Tcl_ListObjAppendElement(NULL, cmd, Tcl_GetObjResult(interp));
+		}
+		Tcl_ResetResult(interp);
+
+		code = Tcl_EvalObjEx(interp, cmd, TCL_EVAL_GLOBAL);
+		if(code != TCL_OK) {
+			Tcl_BackgroundException(interp, code);
+		}
+		Tcl_DecrRefCount(cmd);
+		Tcl_Release((ClientData) interp);
+	}
+
+	releaseAsyncJob(job);
+	freeAsyncJobData(job);
+
+	return 1;
+}
+
+
+static int asyncDeleteProc(Tcl_Event *evPtr, ClientData clientData)
+{
+	return evPtr->proc == asyncEventProc;
+}
+
+
+/* Thread exit handler of the owner threads, see above. */
+static void asyncThreadExit(ClientData clientData)
+{
+	AsyncThreadData *tsdPtr = (AsyncThreadData *) Tcl_GetThreadData(&asyncDataKey, sizeof(AsyncThreadData));
+	AsyncJob *job, *p, *prev;
+	int state;
+
+	Tcl_DeleteEvents(asyncDeleteProc, NULL);
+
+	while((job = tsdPtr->pending) != NULL) {
+		Tcl_MutexLock(&asyncPool.mutex);
+		state = job->state;
+		if(state == ASYNC_QUEUED) {
+			prev = NULL;
+			for(p = asyncPool.head; p != job; p = p->nextQueued) {
+				prev = p;
+			}
+			if(prev != NULL) {
+				prev->nextQueued = job->nextQueued;
+			} else {
+				asyncPool.head = job->nextQueued;
+			}
+			if(asyncPool.tail == job) {
+				asyncPool.tail = prev;
+			}
+		} else if(state == ASYNC_RUNNING) {
+			job->state = ASYNC_ORPHANED;
+		}
+		Tcl_MutexUnlock(&asyncPool.mutex);
+
+		releaseAsyncJob(job);
+		if(state != ASYNC_RUNNING) {
+			freeAsyncJobData(job);
+		}
+	}
+	tsdPtr->initialized = 0;
+}
+
+
+static Tcl_ThreadCreateType asyncWorker(ClientData clientData)
+{
+	AsyncJob *job;
+	AsyncEvent *evPtr;
+
+	Mask_setThreadParallel(0);
+
+	Tcl_MutexLock(&asyncPool.mutex);
+	for(;;) {
+		asyncPool.idle++;
+		while(asyncPool.head == NULL && !asyncPool.shutdown) {
+			Tcl_ConditionWait(&asyncPool.work, &asyncPool.mutex, NULL);
+		}
+		asyncPool.idle--;
+		if(asyncPool.shutdown) break;
+
+		job = asyncPool.head;
+		asyncPool.head = job->nextQueued;
+		if(asyncPool.head == NULL) {
+			asyncPool.tail = NULL;
+		}
+		job->state = ASYNC_RUNNING;
+		Tcl_MutexUnlock(&asyncPool.mutex);
+
+		renderBatchItem(&job->cfg, &job->item);
+
+		Tcl_MutexLock(&asyncPool.mutex);
+		if(job->state == ASYNC_ORPHANED) {
+			freeAsyncJobData(job);
+			continue;
+		}
+		job->state = ASYNC_DONE;
+		evPtr = (AsyncEvent *) ckalloc(sizeof(AsyncEvent));
+		evPtr->header.proc = asyncEventProc;
+		evPtr->job = job;
+		Tcl_ThreadQueueEvent(job->owner, (Tcl_Event *) evPtr, TCL_QUEUE_TAIL);
+		Tcl_ThreadAlert(job->owner);
+	}
+	Tcl_MutexUnlock(&asyncPool.mutex);
+
+	Tcl_ExitThread(0);
+	TCL_THREAD_CREATE_RETURN;
+}
+
+
+static void asyncPoolExit(ClientData clientData)
+{
+	int i, n, result;
+
+	Tcl_MutexLock(&asyncPool.mutex);
+	asyncPool.shutdown = 1;
+	n = asyncPool.workers;
+	Tcl_ConditionNotify(&asyncPool.work);
+	Tcl_MutexUnlock(&asyncPool.mutex);
+
+	for(i = 0; i < n; i++) {
+		Tcl_JoinThread(asyncPool.threads[i], &result);
+	}
+}
+
+
+/*
+ * Queue a job, starting a worker if none is idle and the pool is not full.
+ * Fails only if there is no worker at all.
+ */
+static int queueAsyncJob(AsyncJob *job)
+{
+	int maxWorkers = getProcessorCount();
+	int ok;
+
+	if(maxWorkers > BATCH_MAX_THREADS) maxWorkers = BATCH_MAX_THREADS;
+
+	Tcl_MutexLock(&asyncPool.mutex);
+	if(!asyncPool.shutdown && asyncPool.idle == 0 && asyncPool.workers < maxWorkers) {
+		if(asyncPool.workers == 0) {
+			Tcl_CreateExitHandler(asyncPoolExit, NULL);
+		}
+		if(Tcl_CreateThread(&asyncPool.threads[asyncPool.workers], asyncWorker, NULL,
+				TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE) == TCL_OK) {
+			asyncPool.workers++;
+		}
+	}
+	ok = !asyncPool.shutdown && asyncPool.workers > 0;
+	if(ok) {
+		job->state = ASYNC_QUEUED;
+		job->nextQueued = NULL;
+		if(asyncPool.tail != NULL) {
+			asyncPool.tail->nextQueued = job;
+		} else {
+			asyncPool.head = job;
+		}
+		asyncPool.tail = job;
+		Tcl_ConditionNotify(&asyncPool.work);
+	}
+	Tcl_MutexUnlock(&asyncPool.mutex);
+
+	return ok;
+}
+
+
+int QRENCODEASYNC (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const obj[])
+{
+    EncoderConfig config;
+    AsyncJob *job;
+    AsyncThreadData *tsdPtr;
+    const unsigned char *intext;
+
+    if(objc < 3)
+    {
+        Tcl_WrongNumArgs(interp, 1, obj, "string callback ?-option value ...?");
+        return TCL_ERROR;
+    }
+
+    getDefaultConfig(&config);
+    if(configureEncoder(interp, &config, objc - 3, obj + 3) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    job = (AsyncJob *) ckalloc(sizeof(AsyncJob));
+    memset(job, 0, sizeof(AsyncJob));
+    if(checkConfig(interp, &config, &job->cfg) != TCL_OK) {
+        ckfree((char *) job);
+        return TCL_ERROR;
+    }
+
+    intext = getPayload(obj[1], &job->cfg, &job->item.length, &job->item.binary);
+    if(job->item.length < 1) {
+        ckfree((char *) job);
+        Tcl_SetResult(interp, "empty string", TCL_STATIC);
+        return TCL_ERROR;
+    }
+    job->intext = (unsigned char *) ckalloc(job->item.length + 1);
+    memcpy(job->intext, intext, job->item.length);
+    job->intext[job->item.length] = '\0';
+    job->item.intext = job->intext;
+    job->item.symbols = getCachedSymbols(obj[1], &job->cfg);
+    if(job->item.symbols != NULL) {
+        preserveSymbols(job->item.symbols);
+    }
+
+    job->owner = Tcl_GetCurrentThread();
+    job->interp = interp;
+    Tcl_Preserve((ClientData) interp);
+    job->payload = obj[1];
+    Tcl_IncrRefCount(job->payload);
+    job->callback = obj[2];
+    Tcl_IncrRefCount(job->callback);
+
+    tsdPtr = (AsyncThreadData *) Tcl_GetThreadData(&asyncDataKey, sizeof(AsyncThreadData));
+    if(!tsdPtr->initialized) {
+        Tcl_CreateThreadExitHandler(asyncThreadExit, NULL);
+        tsdPtr->initialized = 1;
+    }
+    job->nextPending = tsdPtr->pending;
+    if(tsdPtr->pending != NULL) {
+        tsdPtr->pending->prevPending = job;
+    }
+    tsdPtr->pending = job;
+
+    if(!queueAsyncJob(job)) {
+        releaseAsyncJob(job);
+        freeAsyncJobData(job);
+        Tcl_SetResult(interp, "can't create a thread", TCL_STATIC);
+        return TCL_ERROR;
     }
 
-    return TCL_OK;  
+    return TCL_OK;
 }
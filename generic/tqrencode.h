@@ -23,6 +23,7 @@ int SETMODE_8BIT (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *
 int SETCASESENSITIVE (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const obj[]);
 int SETKANJI (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const obj[]);
 int SETMICRO (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const obj[]);
+int SETOPTIMIZE (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const obj[]);
 int SETDPI (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const obj[]);
 int SETLEVEL (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const obj[]);
 int SETSIZE (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const obj[]);
@@ -32,5 +33,18 @@ int SETVERSION (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *co
 int SETFOREGROUND (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const obj[]);
 int SETBACKGROUND (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const obj[]);
 int QRENCODE (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const obj[]);
+int QRRENDER (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const obj[]);
+int QRWRITE (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const obj[]);
+int QRCREATE (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const obj[]);
+int QRENCODEBATCH (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const obj[]);
+int QRMATRIX (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const obj[]);
+int QRMEASURE (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const obj[]);
+int QRCACHE (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const obj[]);
+int QRENCODEASYNC (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const obj[]);
+int QRSTATS (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const obj[]);
+int SETPARALLELMASK (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const obj[]);
+int SETARENA (ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const obj[]);
+
+void initParallelMask(void);
 
 #endif